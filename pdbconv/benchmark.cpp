@@ -0,0 +1,219 @@
+#include "y_file.h"
+#include "y_misc.h"
+#include "y_log.h"
+
+#include "definitions.h"
+#include "benchmark.h"
+#include "compression.h"
+#include "decompression.h"
+
+#include "zstd.h"
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+using namespace ynw;
+
+namespace Benchmarking
+{
+	// benchmarks run over a prefix of the input file, so that small fragment sizes finish in reasonable time on multi-GB PDBs
+	constexpr uint64_t k_MaxSampleSize = 32u << 20;
+	constexpr int k_CompressionLevel = 3;
+
+	template <typename Fn>
+	double MeasureSeconds(Fn&& fn)
+	{
+		const std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+		fn();
+		const std::chrono::duration<double> timeInSeconds = std::chrono::high_resolution_clock::now() - startTime;
+		return timeInSeconds.count();
+	}
+
+	// one-shot ZSTD_compress per fragment, vs. a single context with its parameters set once and reused for every fragment
+	void BenchmarkCompressionContexts(const std::span<const uint8_t>& sampleData)
+	{
+		LogInfo("Compression contexts (level %d, %.2fMB sample):", k_CompressionLevel, sampleData.size() * 1.0f / (1 << 20));
+		LogInfo("%13s | %10s | %18s | %18s | %8s", "Fragment size", "Fragments", "One-shot (frag/s)", "Reused (frag/s)", "Speedup");
+		for (const uint32_t fragmentSize : { 0x100u, 0x1000u, 0x100000u })
+		{
+			const size_t numFragments = AlignTo(sampleData.size(), fragmentSize) / fragmentSize;
+			std::vector<uint8_t> compressedData(ZSTD_compressBound(fragmentSize));
+			auto forEachFragment = [&](auto&& compressFn)
+				{
+					for (size_t dataOffset = 0; dataOffset < sampleData.size(); dataOffset += fragmentSize)
+					{
+						const size_t result = compressFn(sampleData.data() + dataOffset, std::min<size_t>(fragmentSize, sampleData.size() - dataOffset));
+						if (ZSTD_isError(result))
+						{
+							ThrowError("Error when compressing data: %s", ZSTD_getErrorName(result));
+						}
+					}
+				};
+
+			const double oneShotSeconds = MeasureSeconds([&]()
+				{
+					forEachFragment([&](const uint8_t* fragmentData, size_t fragmentLength)
+						{
+							return ZSTD_compress(compressedData.data(), compressedData.size(), fragmentData, fragmentLength, k_CompressionLevel);
+						});
+				});
+
+			std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> compressionContext(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+			ZSTD_CCtx_setParameter(compressionContext.get(), ZSTD_c_compressionLevel, k_CompressionLevel);
+			const double reusedSeconds = MeasureSeconds([&]()
+				{
+					forEachFragment([&](const uint8_t* fragmentData, size_t fragmentLength)
+						{
+							return ZSTD_compress2(compressionContext.get(), compressedData.data(), compressedData.size(), fragmentData, fragmentLength);
+						});
+				});
+
+			LogInfo("%13u | %10llu | %18.0f | %18.0f | %7.2fx", fragmentSize, static_cast<uint64_t>(numFragments),
+				numFragments / oneShotSeconds, numFragments / reusedSeconds, oneShotSeconds / reusedSeconds);
+		}
+		LogInfo("");
+	}
+
+	// decompresses MultiFragment-style chunks with one-shot ZSTD_decompress, vs. a single context reused for every chunk
+	void BenchmarkDecompressionContexts(const std::span<const uint8_t>& sampleData)
+	{
+		LogInfo("Decompression contexts (level %d, %.2fMB sample):", k_CompressionLevel, sampleData.size() * 1.0f / (1 << 20));
+		LogInfo("%13s | %10s | %18s | %18s | %8s", "Chunk size", "Chunks", "One-shot (chunk/s)", "Reused (chunk/s)", "Speedup");
+		for (const uint32_t fragmentSize : { 0x100u, 0x1000u, 0x100000u })
+		{
+			// compress the sample upfront, the same way MultiFragment would with a fixed fragment size
+			std::vector<std::vector<uint8_t>> compressedChunks;
+			for (size_t dataOffset = 0; dataOffset < sampleData.size(); dataOffset += fragmentSize)
+			{
+				std::vector<uint8_t>& compressedChunk = compressedChunks.emplace_back(ZSTD_compressBound(fragmentSize));
+				const size_t compressedChunkLength = ZSTD_compress(compressedChunk.data(), compressedChunk.size(), sampleData.data() + dataOffset, std::min<size_t>(fragmentSize, sampleData.size() - dataOffset), k_CompressionLevel);
+				if (ZSTD_isError(compressedChunkLength))
+				{
+					ThrowError("Error when compressing data: %s", ZSTD_getErrorName(compressedChunkLength));
+				}
+				compressedChunk.resize(compressedChunkLength);
+			}
+
+			std::vector<uint8_t> decompressedData(fragmentSize);
+			auto forEachChunk = [&](auto&& decompressFn)
+				{
+					for (const std::vector<uint8_t>& compressedChunk : compressedChunks)
+					{
+						const size_t result = decompressFn(compressedChunk);
+						if (ZSTD_isError(result))
+						{
+							ThrowError("Error when decompressing data: %s", ZSTD_getErrorName(result));
+						}
+					}
+				};
+
+			const double oneShotSeconds = MeasureSeconds([&]()
+				{
+					forEachChunk([&](const std::vector<uint8_t>& compressedChunk)
+						{
+							return ZSTD_decompress(decompressedData.data(), decompressedData.size(), compressedChunk.data(), compressedChunk.size());
+						});
+				});
+
+			std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> decompressionContext(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+			const double reusedSeconds = MeasureSeconds([&]()
+				{
+					forEachChunk([&](const std::vector<uint8_t>& compressedChunk)
+						{
+							return ZSTD_decompressDCtx(decompressionContext.get(), decompressedData.data(), decompressedData.size(), compressedChunk.data(), compressedChunk.size());
+						});
+				});
+
+			const size_t numChunks = compressedChunks.size();
+			LogInfo("%13u | %10llu | %18.0f | %18.0f | %7.2fx", fragmentSize, static_cast<uint64_t>(numChunks),
+				numChunks / oneShotSeconds, numChunks / reusedSeconds, oneShotSeconds / reusedSeconds);
+		}
+		LogInfo("");
+	}
+
+	// Reading every tiny stream of a converted PDB, like opening it does for the PDB info, names and small debug streams. The input is converted
+	// twice, once keeping every stream in chunks and once with --raw_stream_size, and the tiny streams of both files are read back through the
+	// MSFZ reader, starting from the file layout.
+	void BenchmarkTinyStreamReads(const ProgramCommandLineArgs& args)
+	{
+		constexpr uint32_t k_MaxTinyStreamSize = 0x400;
+		constexpr uint32_t k_NumReadPasses = 8;
+
+		LogInfo("Tiny stream reads (MultiFragment, level %d, streams of at most %uB):", k_CompressionLevel, k_MaxTinyStreamSize);
+		LogInfo("%15s | %12s | %8s | %8s | %11s | %12s", "Raw stream size", "File size", "Chunks", "Streams", "Layout (ms)", "Streams (ms)");
+		for (const uint32_t maxRawStreamSize : { 0u, k_MaxTinyStreamSize })
+		{
+			ProgramCommandLineArgs compressionArgs = {};
+			compressionArgs.m_InputFilePath = args.m_InputFilePath;
+			compressionArgs.m_OutputFilePath = (std::filesystem::temp_directory_path() / ("pdbconv_benchmark_R" + std::to_string(maxRawStreamSize) + ".msfz")).string();
+			compressionArgs.m_UsageMode = UsageMode::Compress;
+			compressionArgs.m_CompressionStrategy = CompressionStrategy::MultiFragment;
+			compressionArgs.m_CompressionLevel = k_CompressionLevel;
+			compressionArgs.m_FixedFragmentSize = 0x1000;
+			compressionArgs.m_MaxFragmentsPerStream = 0x1000;
+			compressionArgs.m_MaxRawStreamSize = maxRawStreamSize;
+			{
+				SuppressLogInScope();
+				Compression::RunCompression(compressionArgs);
+			}
+
+			const char* msfzFilePath = compressionArgs.m_OutputFilePath.c_str();
+			MsfzFileLayout layout;
+			const double layoutSeconds = MeasureSeconds([&]()
+				{
+					for (uint32_t passIndex = 0; passIndex < k_NumReadPasses; ++passIndex)
+					{
+						Decompression::ReadFileLayout(msfzFilePath, layout);
+					}
+				});
+
+			std::vector<uint32_t> tinyStreamIndices;
+			for (uint32_t streamIndex = 0; streamIndex < layout.m_Streams.size(); ++streamIndex)
+			{
+				const uint32_t streamSize = layout.m_Streams[streamIndex].CalculateSize();
+				if (streamSize != 0 && streamSize <= k_MaxTinyStreamSize)
+				{
+					tinyStreamIndices.push_back(streamIndex);
+				}
+			}
+
+			std::vector<uint8_t> streamData;
+			const double streamsSeconds = MeasureSeconds([&]()
+				{
+					for (uint32_t passIndex = 0; passIndex < k_NumReadPasses; ++passIndex)
+					{
+						for (const uint32_t streamIndex : tinyStreamIndices)
+						{
+							Decompression::ReadStreamData(msfzFilePath, layout, streamIndex, streamData);
+						}
+					}
+				});
+
+			LogInfo("%15u | %12llu | %8llu | %8llu | %11.3f | %12.3f", maxRawStreamSize, static_cast<uint64_t>(std::filesystem::file_size(compressionArgs.m_OutputFilePath)),
+				static_cast<uint64_t>(layout.m_Chunks.size()), static_cast<uint64_t>(tinyStreamIndices.size()), layoutSeconds * 1000.0 / k_NumReadPasses, streamsSeconds * 1000.0 / k_NumReadPasses);
+			std::filesystem::remove(compressionArgs.m_OutputFilePath);
+		}
+		LogInfo("");
+	}
+
+	void RunBenchmark(const ProgramCommandLineArgs& args)
+	{
+		SimpleFile inputFile(args.m_InputFilePath.c_str());
+		{
+			LogScoped("Opening input file");
+			if (!inputFile.Open(false))
+			{
+				ThrowError("Unable to open input file.");
+			}
+		}
+
+		const std::span<const uint8_t> sampleData = { static_cast<const uint8_t*>(inputFile.GetData()), StrictCastTo<size_t>(std::min(inputFile.GetSize(), k_MaxSampleSize)) };
+		BenchmarkCompressionContexts(sampleData);
+		BenchmarkDecompressionContexts(sampleData);
+		BenchmarkTinyStreamReads(args);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#pragma once
+
+struct ProgramCommandLineArgs;
+
+namespace Benchmarking
+{
+	void RunBenchmark(const ProgramCommandLineArgs& args);
+}
\ No newline at end of file
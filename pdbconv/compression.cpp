@@ -12,348 +12,2328 @@
 
 #include <span>
 #include <vector>
+#include <memory>
+#include <optional>
 #include <algorithm>
 #include <numeric>
+#include <thread>
+#include <mutex>
+#include <string_view>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <cmath>
 
 using namespace ynw;
 
 namespace Compression
 {
+	enum RecordFormat : uint8_t
+	{
+		CodeViewRecords,	// type and symbol records: u16 record length, not counting the length itself, then the record
+		DebugSubsections	// C13 line info: u32 subsection kind, u32 subsection length, then the subsection padded to 4 bytes
+	};
+
+	// a part of a stream made of variable-size records
+	struct RecordRegion
+	{
+		uint32_t m_BeginOffset = 0;
+		uint32_t m_EndOffset = 0;
+		RecordFormat m_Format = RecordFormat::CodeViewRecords;
+	};
+
+	// how a single stream gets compressed: the compression arguments, with the compression policy applied on top of them
+	struct StreamCompressionSettings
+	{
+		CompressionStrategy m_Strategy = CompressionStrategy::SingleFragment;
+		uint32_t m_Level = 3u;
+		uint32_t m_FixedFragmentSize = 0x1000u;
+		uint32_t m_MaxFragmentsPerStream = 0x1000u;
+		bool m_AlignFragmentsToRecords = false;
+		uint32_t m_RawChunkThreshold = 97u;	// chunks that don't compress below this percentage of their size are stored raw
+	};
+
 	struct PDBStreamInfo
 	{
 		uint32_t m_StreamSize = 0;
 		std::vector<uint32_t> m_StreamBlockIndices;
+		std::vector<IndexRun> m_StreamBlockRuns;	// m_StreamBlockIndices split into runs of blocks that are next to each other in the file
+		StreamRole m_Role = StreamRole::UnknownStream;
+		std::vector<RecordRegion> m_RecordRegions;	// in stream order, not overlapping
+		std::vector<uint32_t> m_RecordBoundaryHints;	// sorted offsets of some of the records in m_RecordRegions, e.g. from the TPI hash stream
+		StreamCompressionSettings m_CompressionSettings;
+		uint32_t m_ModuleIndex = UINT32_MAX;	// position of the module in the DBI module info, for module symbol streams
+	};
+
+	void SetStreamBlockIndices(PDBStreamInfo& streamInfo, std::vector<uint32_t>&& blockIndices)
+	{
+		streamInfo.m_StreamBlockIndices = std::move(blockIndices);
+		SplitIntoConsecutiveRuns(streamInfo.m_StreamBlockIndices, streamInfo.m_StreamBlockRuns);
+	}
+
+	// Input PDB file. By default the whole file is mapped, but when a memory limit is given nothing is mapped and the data
+	// is read on demand, so that resident memory stays bounded no matter how large the input is.
+	class PDBInputFile
+	{
+	public:
+		PDBInputFile(const char* path)
+			: m_File(path)
+		{
+		}
+
+		bool Open(const uint64_t memoryLimitInBytes)
+		{
+			m_MemoryLimitInBytes = memoryLimitInBytes;
+			return m_File.Open(false, true, !IsStreamed());
+		}
+
+		bool ReadBytes(const uint64_t offset, void* outData, const size_t numBytes) const
+		{
+			if (offset > m_File.GetSize() || offset + numBytes > m_File.GetSize())
+			{
+				return false;
+			}
+			if (IsStreamed())
+			{
+				return m_File.ReadAt(offset, outData, numBytes);
+			}
+			memcpy(outData, static_cast<const uint8_t*>(m_File.GetData()) + offset, numBytes);
+			return true;
+		}
+
+		// number of blocks each concurrent stream reader may keep resident, so that all readers together stay within their part of the memory limit.
+		// there's at most one reader per worker of the pool.
+		uint32_t GetNumBlocksPerReader(const uint32_t blockSize) const
+		{
+			const uint64_t numBlocksTotal = GetReaderMemoryLimit() / blockSize;
+			return std::max(1u, StrictCastTo<uint32_t>(numBlocksTotal / ThreadPool::Get().GetNumThreads()));
+		}
+
+		// a quarter of the memory limit goes to the stream readers, the rest to the fragment ranges that are being compressed, see CompressAndWriteStreamData()
+		uint64_t GetReaderMemoryLimit() const { return m_MemoryLimitInBytes / 4; }
+		uint64_t GetInFlightMemoryLimit() const { return m_MemoryLimitInBytes - GetReaderMemoryLimit(); }
+
+		// hints that a part of the mapped input is about to be read
+		void Prefetch(const uint64_t offset, const size_t numBytes) const
+		{
+			if (!IsStreamed())
+			{
+				m_File.Prefetch(offset, numBytes);
+			}
+		}
+
+		bool IsStreamed() const { return m_MemoryLimitInBytes != 0; }
+		ImmutableStream GetMappedStream() const { assert(!IsStreamed()); return ImmutableStream(m_File.GetData(), m_File.GetSize()); }
+		uint64_t GetSize() const { return m_File.GetSize(); }
+
+	private:
+		SimpleFile m_File;
+		uint64_t m_MemoryLimitInBytes = 0;
+	};
+
+	bool AreStreamBlocksContiguous(const PDBStreamInfo& streamInfo)
+	{
+		return streamInfo.m_StreamBlockRuns.size() == 1;
+	}
+
+	// Walks a single stream front to back, following the stream's block runs.
+	// When the input is mapped, the returned views point straight into the mapping and span up to a whole run of blocks,
+	// so streams scattered across the file are read without copying. Otherwise a fixed-size window is refilled with preads,
+	// one read per run.
+	class StreamBlockReader
+	{
+	public:
+		StreamBlockReader(const PDBInputFile& inputFile, const PDBStreamInfo& streamInfo, const uint32_t blockSize, const uint32_t numBlocksInWindow, const uint64_t startOffset = 0)
+			: m_InputFile(inputFile)
+			, m_StreamInfo(streamInfo)
+			, m_BlockSize(blockSize)
+			, m_WindowBeginOffset(startOffset - startOffset % blockSize)
+			, m_WindowEndOffset(m_WindowBeginOffset)
+			, m_ReadOffset(startOffset)
+		{
+			if (inputFile.IsStreamed())
+			{
+				m_Window.resize(std::min<size_t>(static_cast<size_t>(numBlocksInWindow) * blockSize, AlignTo(streamInfo.m_StreamSize, blockSize)));
+			}
+		}
+
+		// returns a view of the next numBytes bytes in the stream if they're all within a single block run of the mapped input, nothing otherwise
+		std::optional<std::span<const uint8_t>> TryReadInPlace(const size_t numBytes)
+		{
+			if (m_InputFile.IsStreamed())
+			{
+				return std::nullopt;
+			}
+
+			const uint32_t firstBlock = StrictCastTo<uint32_t>(m_ReadOffset / m_BlockSize);
+			const IndexRun& run = SeekToRunContaining(firstBlock);
+			const uint64_t runEndOffset = std::min<uint64_t>(static_cast<uint64_t>(m_RunFirstStreamBlock + run.m_Count) * m_BlockSize, m_StreamInfo.m_StreamSize);
+			if (m_ReadOffset + numBytes > runEndOffset)
+			{
+				return std::nullopt;
+			}
+			return ReadNextMapped(numBytes);
+		}
+
+		// returns a view of at most maxNumBytes next bytes in the stream, which stays valid until the next call
+		std::span<const uint8_t> ReadNext(const size_t maxNumBytes)
+		{
+			if (!m_InputFile.IsStreamed())
+			{
+				return ReadNextMapped(maxNumBytes);
+			}
+
+			if (m_ReadOffset >= m_WindowEndOffset)
+			{
+				FillWindow();
+			}
+
+			const size_t numBytes = std::min<size_t>(maxNumBytes, m_WindowEndOffset - m_ReadOffset);
+			const std::span<const uint8_t> result = { m_Window.data() + (m_ReadOffset - m_WindowBeginOffset), numBytes };
+			m_ReadOffset += numBytes;
+			return result;
+		}
+
+		// reads the next numBytes bytes of the stream straight into outData, one read per run of blocks, without going through the window
+		void ReadInto(uint8_t* outData, const size_t numBytes)
+		{
+			ForEachFileRangeOfNext(numBytes, [this, &outData](const uint64_t fileOffset, const size_t rangeSize)
+				{
+					if (!m_InputFile.ReadBytes(fileOffset, outData, rangeSize))
+					{
+						ThrowError("Unable to read stream data from the input file. Offset: %llu, Size: %llu", fileOffset, static_cast<uint64_t>(rangeSize));
+					}
+					outData += rangeSize;
+				});
+		}
+
+		// moves forward to streamOffset without reading the bytes in between
+		void SkipTo(const uint64_t streamOffset)
+		{
+			assert(streamOffset >= m_ReadOffset);
+			m_ReadOffset = streamOffset;
+		}
+
+		uint64_t GetReadOffset() const { return m_ReadOffset; }
+
+		// lets the OS start paging in the next numBytes bytes of the stream from the mapped input, one hint per run of blocks
+		void PrefetchNext(const size_t numBytes)
+		{
+			ForEachFileRangeOfNext(numBytes, [this](const uint64_t fileOffset, const size_t rangeSize) { m_InputFile.Prefetch(fileOffset, rangeSize); });
+		}
+
+	private:
+		template <typename RangeFn>
+		void ForEachFileRangeOfNext(const size_t numBytes, RangeFn&& rangeFn)
+		{
+			const uint64_t endOffset = std::min<uint64_t>(m_ReadOffset + numBytes, m_StreamInfo.m_StreamSize);
+			while (m_ReadOffset < endOffset)
+			{
+				const uint32_t streamBlock = StrictCastTo<uint32_t>(m_ReadOffset / m_BlockSize);
+				const IndexRun& run = SeekToRunContaining(streamBlock);
+				const uint64_t rangeEndOffset = std::min<uint64_t>(static_cast<uint64_t>(m_RunFirstStreamBlock + run.m_Count) * m_BlockSize, endOffset);
+				const uint64_t fileOffset = static_cast<uint64_t>(run.m_First + (streamBlock - m_RunFirstStreamBlock)) * m_BlockSize + m_ReadOffset % m_BlockSize;
+				rangeFn(fileOffset, StrictCastTo<size_t>(rangeEndOffset - m_ReadOffset));
+				m_ReadOffset = rangeEndOffset;
+			}
+		}
+
+		std::span<const uint8_t> ReadNextMapped(const size_t maxNumBytes)
+		{
+			const uint32_t firstBlock = StrictCastTo<uint32_t>(m_ReadOffset / m_BlockSize);
+			const uint64_t offsetInFirstBlock = m_ReadOffset % m_BlockSize;
+			const uint64_t maxReadEndOffset = std::min<uint64_t>(m_ReadOffset + maxNumBytes, m_StreamInfo.m_StreamSize);
+
+			// the view extends up to the end of the run the first block is in
+			const IndexRun& run = SeekToRunContaining(firstBlock);
+			const uint64_t readEndOffset = std::min<uint64_t>(static_cast<uint64_t>(m_RunFirstStreamBlock + run.m_Count) * m_BlockSize, maxReadEndOffset);
+			const size_t numBytes = StrictCastTo<size_t>(readEndOffset - m_ReadOffset);
+			const uint64_t fileOffset = static_cast<uint64_t>(run.m_First + (firstBlock - m_RunFirstStreamBlock)) * m_BlockSize + offsetInFirstBlock;
+			const ImmutableStream pdbFileStream = m_InputFile.GetMappedStream();
+			if (!pdbFileStream.CanRead(fileOffset, numBytes))
+			{
+				ThrowError("Unable to read stream data from the input file. Offset: %llu, Size: %llu", fileOffset, static_cast<uint64_t>(numBytes));
+			}
+
+			m_ReadOffset = readEndOffset;
+			return { pdbFileStream.PeekAtOffset<uint8_t>(fileOffset), numBytes };
+		}
+
+		void FillWindow()
+		{
+			// the window starts at the block that's read next, which is where the previous window ended unless the stream has been read past it with ReadInto()
+			const uint32_t firstBlock = StrictCastTo<uint32_t>(m_ReadOffset / m_BlockSize);
+			const uint32_t numBlocks = std::min(StrictCastTo<uint32_t>(m_Window.size() / m_BlockSize), StrictCastTo<uint32_t>(m_StreamInfo.m_StreamBlockIndices.size()) - firstBlock);
+			for (uint32_t blockInWindow = 0; blockInWindow < numBlocks;)
+			{
+				const uint32_t streamBlock = firstBlock + blockInWindow;
+				const IndexRun& run = SeekToRunContaining(streamBlock);
+				const uint32_t numRunBlocks = std::min(numBlocks - blockInWindow, m_RunFirstStreamBlock + run.m_Count - streamBlock);
+
+				// the last block of the stream is usually only partially used and may be the last block in the file too
+				const uint64_t runStreamOffset = static_cast<uint64_t>(streamBlock) * m_BlockSize;
+				const uint64_t runFileOffset = static_cast<uint64_t>(run.m_First + (streamBlock - m_RunFirstStreamBlock)) * m_BlockSize;
+				const size_t runSize = StrictCastTo<size_t>(std::min<uint64_t>(static_cast<uint64_t>(numRunBlocks) * m_BlockSize, m_StreamInfo.m_StreamSize - runStreamOffset));
+				if (!m_InputFile.ReadBytes(runFileOffset, m_Window.data() + static_cast<size_t>(blockInWindow) * m_BlockSize, runSize))
+				{
+					ThrowError("Unable to read stream data from the input file. Offset: %llu, Size: %llu", runFileOffset, static_cast<uint64_t>(runSize));
+				}
+				blockInWindow += numRunBlocks;
+			}
+
+			m_WindowBeginOffset = static_cast<uint64_t>(firstBlock) * m_BlockSize;
+			m_WindowEndOffset = std::min<uint64_t>(m_WindowBeginOffset + static_cast<uint64_t>(numBlocks) * m_BlockSize, m_StreamInfo.m_StreamSize);
+		}
+
+		// the stream is always read front to back, so the run cursor only ever moves forward
+		const IndexRun& SeekToRunContaining(const uint32_t streamBlock)
+		{
+			const std::vector<IndexRun>& blockRuns = m_StreamInfo.m_StreamBlockRuns;
+			while (streamBlock >= m_RunFirstStreamBlock + blockRuns[m_RunIndex].m_Count)
+			{
+				m_RunFirstStreamBlock += blockRuns[m_RunIndex].m_Count;
+				++m_RunIndex;
+			}
+			return blockRuns[m_RunIndex];
+		}
+
+		const PDBInputFile& m_InputFile;
+		const PDBStreamInfo& m_StreamInfo;
+		const uint32_t m_BlockSize;
+		size_t m_RunIndex = 0;
+		uint32_t m_RunFirstStreamBlock = 0;
+		std::vector<uint8_t> m_Window;
+		uint64_t m_WindowBeginOffset;
+		uint64_t m_WindowEndOffset;
+		uint64_t m_ReadOffset;
 	};
 
-	uint32_t GetFragmentSizeForStream(const uint32_t streamSize, const ProgramCommandLineArgs& args)
+	// reads numBytes bytes of a stream starting at streamOffset, returns false if the stream isn't that large
+	bool ReadStreamBytes(const PDBInputFile& inputFile, const PDBStreamInfo& streamInfo, const uint32_t blockSize, const uint64_t streamOffset, const size_t numBytes, void* outData)
+	{
+		if (streamOffset + numBytes > streamInfo.m_StreamSize)
+		{
+			return false;
+		}
+		if (numBytes != 0)
+		{
+			StreamBlockReader blockReader(inputFile, streamInfo, blockSize, 0, streamOffset);
+			blockReader.ReadInto(static_cast<uint8_t*>(outData), numBytes);
+		}
+		return true;
+	}
+
+	uint32_t GetFragmentSizeForStream(const PDBStreamInfo& streamInfo)
 	{
 		// max frps takes precedence over fixed fragment size
-		const CompressionStrategy compressionStrategy = args.m_CompressionStrategy.value();
-		if (compressionStrategy == CompressionStrategy::MultiFragment)
+		const StreamCompressionSettings& compressionSettings = streamInfo.m_CompressionSettings;
+		const uint32_t streamSize = streamInfo.m_StreamSize;
+		if (compressionSettings.m_Strategy == CompressionStrategy::MultiFragment)
+		{
+			const uint32_t fixedFragmentSize = compressionSettings.m_FixedFragmentSize;
+			const uint32_t maxFrps = compressionSettings.m_MaxFragmentsPerStream;
+			return std::min(streamSize, std::max(fixedFragmentSize, StrictCastTo<uint32_t>(AlignTo(streamSize, maxFrps)) / maxFrps));
+		}
+		else
+		{
+			return streamSize;
+		}
+	}
+
+	// Walks the records in the record regions of a stream front to back, reading only the record headers. The offsets it's asked about have to
+	// go front to back too, so that the stream is read in a single pass. Once a record turns out to be malformed, the rest of the stream is
+	// treated as if it had no records.
+	class RecordWalker
+	{
+	public:
+		RecordWalker(const PDBInputFile& inputFile, const PDBStreamInfo& streamInfo, const uint32_t blockSize)
+			: m_Regions(streamInfo.m_RecordRegions)
+			, m_BoundaryHints(streamInfo.m_RecordBoundaryHints)
+			, m_BlockReader(inputFile, streamInfo, blockSize, inputFile.GetNumBlocksPerReader(blockSize))
+		{
+			if (!m_Regions.empty())
+			{
+				m_RecordOffset = m_Regions.front().m_BeginOffset;
+			}
+		}
+
+		// returns the next record, false once there are no more records
+		bool NextRecord(uint32_t& outBeginOffset, uint32_t& outEndOffset)
+		{
+			while (m_RegionIndex < m_Regions.size() && m_RecordOffset >= m_Regions[m_RegionIndex].m_EndOffset)
+			{
+				if (++m_RegionIndex < m_Regions.size())
+				{
+					m_RecordOffset = m_Regions[m_RegionIndex].m_BeginOffset;
+				}
+			}
+			if (m_RegionIndex == m_Regions.size() || !ReadRecordEnd())
+			{
+				return false;
+			}
+
+			outBeginOffset = m_RecordOffset;
+			outEndOffset = m_RecordEnd;
+			m_RecordOffset = m_RecordEnd;
+			m_RecordEnd = 0;
+			return true;
+		}
+
+		// returns the record boundary after beginOffset that's closest to targetOffset, or targetOffset itself if it isn't within a record region
+		uint32_t FindClosestBoundary(const uint32_t beginOffset, const uint32_t targetOffset)
+		{
+			while (m_RegionIndex < m_Regions.size() && m_Regions[m_RegionIndex].m_EndOffset <= targetOffset)
+			{
+				++m_RegionIndex;
+				m_RecordEnd = 0;
+			}
+			if (m_IsMalformed || m_RegionIndex == m_Regions.size() || m_Regions[m_RegionIndex].m_BeginOffset >= targetOffset)
+			{
+				return targetOffset;
+			}
+
+			const RecordRegion& region = m_Regions[m_RegionIndex];
+			if (m_RecordOffset < region.m_BeginOffset)
+			{
+				m_RecordOffset = region.m_BeginOffset;
+				m_RecordEnd = 0;
+			}
+
+			// known record boundaries let the walk skip the records in between without reading them
+			const auto hintIt = std::upper_bound(m_BoundaryHints.begin(), m_BoundaryHints.end(), targetOffset);
+			if (hintIt != m_BoundaryHints.begin())
+			{
+				const uint32_t hintOffset = *(hintIt - 1);
+				if (hintOffset > m_RecordOffset && hintOffset >= m_RecordEnd && hintOffset < region.m_EndOffset)
+				{
+					m_RecordOffset = hintOffset;
+					m_RecordEnd = 0;
+				}
+			}
+
+			while (ReadRecordEnd() && m_RecordEnd <= targetOffset)
+			{
+				m_RecordOffset = m_RecordEnd;
+				m_RecordEnd = 0;
+			}
+			if (m_IsMalformed)
+			{
+				return targetOffset;
+			}
+
+			// the target falls within the record at m_RecordOffset
+			const bool isRecordBeginCloser = targetOffset - m_RecordOffset <= m_RecordEnd - targetOffset;
+			return isRecordBeginCloser && m_RecordOffset > beginOffset ? m_RecordOffset : m_RecordEnd;
+		}
+
+	private:
+		bool ReadRecordEnd()
+		{
+			if (m_RecordEnd != 0)
+			{
+				return true;
+			}
+
+			const RecordRegion& region = m_Regions[m_RegionIndex];
+			const uint32_t headerSize = region.m_Format == RecordFormat::CodeViewRecords ? sizeof(uint16_t) : 2 * sizeof(uint32_t);
+			if (m_IsMalformed || static_cast<uint64_t>(m_RecordOffset) + headerSize > region.m_EndOffset || m_RecordOffset < m_BlockReader.GetReadOffset())
+			{
+				m_IsMalformed = true;
+				return false;
+			}
+
+			uint8_t header[2 * sizeof(uint32_t)] = {};
+			m_BlockReader.SkipTo(m_RecordOffset);
+			for (uint32_t numHeaderBytesRead = 0; numHeaderBytesRead < headerSize;)
+			{
+				const std::span<const uint8_t> headerPart = m_BlockReader.ReadNext(headerSize - numHeaderBytesRead);
+				memcpy(header + numHeaderBytesRead, headerPart.data(), headerPart.size());
+				numHeaderBytesRead += StrictCastTo<uint32_t>(headerPart.size());
+			}
+
+			uint64_t recordEnd = 0;
+			if (region.m_Format == RecordFormat::CodeViewRecords)
+			{
+				uint16_t recordLength = 0;
+				memcpy(&recordLength, header, sizeof(recordLength));
+				recordEnd = static_cast<uint64_t>(m_RecordOffset) + headerSize + recordLength;
+			}
+			else
+			{
+				uint32_t subsectionLength = 0;
+				memcpy(&subsectionLength, header + sizeof(uint32_t), sizeof(subsectionLength));
+				recordEnd = static_cast<uint64_t>(m_RecordOffset) + headerSize + AlignTo<uint64_t>(subsectionLength, sizeof(uint32_t));
+			}
+			if (recordEnd > region.m_EndOffset)
+			{
+				m_IsMalformed = true;
+				return false;
+			}
+			m_RecordEnd = StrictCastTo<uint32_t>(recordEnd);
+			return true;
+		}
+
+		const std::vector<RecordRegion>& m_Regions;
+		const std::vector<uint32_t>& m_BoundaryHints;
+		StreamBlockReader m_BlockReader;
+		size_t m_RegionIndex = 0;
+		uint32_t m_RecordOffset = 0;
+		uint32_t m_RecordEnd = 0;	// end of the record at m_RecordOffset, 0 until its header is read
+		bool m_IsMalformed = false;
+	};
+
+	// Chunk data is appended to the output file as chunks get compressed, so the file only grows by as much as the chunks actually take up.
+	// Only the commit stage of the compression pipeline appends chunk data, so there's no need for a lock.
+	class ChunkDataWriter
+	{
+	public:
+		ChunkDataWriter(BufferedFileWriter& fileWriter, const uint32_t rawChunkAlignment)
+			: m_FileWriter(fileWriter)
+			, m_RawChunkAlignment(rawChunkAlignment)
+			, m_Padding(rawChunkAlignment, 0u)
+		{
+		}
+
+		// 0 when raw chunks aren't aligned
+		uint32_t GetRawChunkAlignment() const { return m_RawChunkAlignment; }
+		uint32_t GetNumAlignedChunks() const { return m_NumAlignedChunks; }
+		uint64_t GetNumPaddingBytes() const { return m_NumPaddingBytes; }
+
+		// bytes left until the next aligned offset
+		uint32_t GetPaddingSize() const
+		{
+			const uint64_t offset = m_FileWriter.GetOffset();
+			return StrictCastTo<uint32_t>(AlignTo<uint64_t>(offset, m_RawChunkAlignment) - offset);
+		}
+
+		uint32_t Append(const std::span<const uint8_t>& chunkData)
+		{
+			const uint64_t chunkOffset = m_FileWriter.GetOffset();
+			if (!m_FileWriter.Append(chunkData.data(), chunkData.size()))
+			{
+				ThrowError("Unable to write chunk data to the output file. Offset: %llu, Size: %llu", chunkOffset, static_cast<uint64_t>(chunkData.size()));
+			}
+			return StrictCastTo<uint32_t>(chunkOffset);
+		}
+
+		uint32_t AppendAligned(const std::span<const uint8_t>& chunkData)
+		{
+			const uint32_t paddingSize = GetPaddingSize();
+			if (paddingSize != 0)
+			{
+				Append({ m_Padding.data(), paddingSize });
+				m_NumPaddingBytes += paddingSize;
+			}
+			++m_NumAlignedChunks;
+			return Append(chunkData);
+		}
+
+	private:
+		BufferedFileWriter& m_FileWriter;
+		const uint32_t m_RawChunkAlignment = 0;
+		const std::vector<uint8_t> m_Padding;
+		uint32_t m_NumAlignedChunks = 0;
+		uint64_t m_NumPaddingBytes = 0;
+	};
+
+	// Slab holding the chunk data of one fragment range. Fragments are compressed straight into the slab's free space and the slab is appended to
+	// the output file as a whole once the range is committed, so compressed bytes are written exactly once and no buffer is allocated per fragment.
+	// Where chunks end up in the file is only known once their slab is flushed, so chunk descriptors are kept in the slab until then.
+	class ChunkDataSlab
+	{
+	public:
+		static constexpr size_t k_MinCapacity = 1u << 20;
+
+		// returns space for a chunk of up to maxChunkSize bytes
+		uint8_t* BeginChunk(const size_t maxChunkSize)
+		{
+			return GrowChunk(0, maxChunkSize);
+		}
+
+		// makes room for the chunk that's being written to grow up to maxChunkSize bytes, keeping the first numBytesWritten bytes.
+		// slabs are reused for later ranges, so a slab that had to grow for a large range stays that large.
+		uint8_t* GrowChunk(const size_t numBytesWritten, const size_t maxChunkSize)
+		{
+			const size_t requiredCapacity = m_UsedSize + maxChunkSize;
+			if (requiredCapacity > m_Capacity)
+			{
+				const size_t newCapacity = std::max({ requiredCapacity, m_Capacity * 2, k_MinCapacity });
+				std::unique_ptr<uint8_t[]> newData(new uint8_t[newCapacity]);
+				if (m_Data)
+				{
+					memcpy(newData.get(), m_Data.get(), m_UsedSize + numBytesWritten);
+				}
+				m_Data = std::move(newData);
+				m_Capacity = newCapacity;
+			}
+			return m_Data.get() + m_UsedSize;
+		}
+
+		size_t GetCapacity() const { return m_Capacity; }
+
+		// ends the chunk that's being written as a chunk of chunkSize bytes, holding the whole data of the fragments in it
+		void EndChunk(const size_t chunkSize, const uint32_t decompressedSize, const bool isCompressed)
+		{
+			MsfzChunk& chunkDesc = m_PendingChunks.emplace_back();
+			chunkDesc.m_OffsetToChunkData = StrictCastTo<uint32_t>(m_UsedSize);	// relative to the slab until it gets flushed
+			chunkDesc.m_OriginToChunk = 0;
+			chunkDesc.m_IsCompressed = isCompressed;
+			chunkDesc.m_CompressedSize = StrictCastTo<uint32_t>(chunkSize);
+			chunkDesc.m_DecompressedSize = decompressedSize;
+			m_UsedSize += chunkSize;
+		}
+
+		// appends the chunk data to the output file and writes the chunk descriptors to the chunk metadata, starting at firstChunkIndex.
+		// slabs are flushed in the order their ranges were planned in, which makes chunk offsets follow the chunk indices, no matter which thread compressed what.
+		void Flush(ChunkDataWriter& chunkDataWriter, const MutableStreamFixed& chunkMetadataStream, const uint32_t firstChunkIndex)
+		{
+			if (m_PendingChunks.empty())
+			{
+				return;
+			}
+
+			MutableStreamFixed chunkDescsStream = chunkMetadataStream.GetStreamAtOffset(sizeof(MsfzChunk) * static_cast<uint64_t>(firstChunkIndex), sizeof(MsfzChunk) * m_PendingChunks.size());
+			if (chunkDescsStream.GetData() == nullptr)
+			{
+				ThrowError("Unable to write chunk descriptors. First chunk index: %u, Chunk count: %llu", firstChunkIndex, static_cast<uint64_t>(m_PendingChunks.size()));
+			}
+
+			if (chunkDataWriter.GetRawChunkAlignment() != 0)
+			{
+				AppendChunksWithAlignedRawChunks(chunkDataWriter);
+			}
+			else
+			{
+				const uint32_t slabOffsetInFile = chunkDataWriter.Append({ m_Data.get(), m_UsedSize });
+				for (MsfzChunk& chunkDesc : m_PendingChunks)
+				{
+					chunkDesc.m_OffsetToChunkData = StrictCastTo<uint32_t>(static_cast<uint64_t>(slabOffsetInFile) + chunkDesc.m_OffsetToChunkData);
+				}
+			}
+			chunkDescsStream.WriteSpan<MsfzChunk>(m_PendingChunks);
+
+			m_PendingChunks.clear();
+			m_UsedSize = 0;
+		}
+
+	private:
+		// Raw chunks of at least the alignment start at an aligned offset, so a reader that maps the file can hand out views of them straight
+		// from the page cache. The other chunks of the slab go in the padding in front of them wherever they fit, which keeps the padding small.
+		// Chunk offsets then don't follow the chunk indices within a slab anymore, but every chunk descriptor has its own offset anyway.
+		void AppendChunksWithAlignedRawChunks(ChunkDataWriter& chunkDataWriter)
+		{
+			const uint32_t rawChunkAlignment = chunkDataWriter.GetRawChunkAlignment();
+			const auto isAligned = [rawChunkAlignment](const MsfzChunk& chunkDesc)
+				{
+					return !chunkDesc.m_IsCompressed && chunkDesc.m_CompressedSize >= rawChunkAlignment;
+				};
+			const auto getChunkData = [this](const MsfzChunk& chunkDesc) -> std::span<const uint8_t>
+				{
+					return { m_Data.get() + chunkDesc.m_OffsetToChunkData, chunkDesc.m_CompressedSize };
+				};
+
+			std::vector<MsfzChunk*> fillerChunks;
+			for (MsfzChunk& chunkDesc : m_PendingChunks)
+			{
+				if (!isAligned(chunkDesc))
+				{
+					fillerChunks.push_back(&chunkDesc);
+				}
+			}
+
+			size_t numFillerChunksAppended = 0;
+			for (MsfzChunk& chunkDesc : m_PendingChunks)
+			{
+				if (!isAligned(chunkDesc))
+				{
+					continue;
+				}
+				while (numFillerChunksAppended < fillerChunks.size() && fillerChunks[numFillerChunksAppended]->m_CompressedSize <= chunkDataWriter.GetPaddingSize())
+				{
+					MsfzChunk& fillerChunkDesc = *fillerChunks[numFillerChunksAppended++];
+					fillerChunkDesc.m_OffsetToChunkData = chunkDataWriter.Append(getChunkData(fillerChunkDesc));
+				}
+				chunkDesc.m_OffsetToChunkData = chunkDataWriter.AppendAligned(getChunkData(chunkDesc));
+			}
+			for (; numFillerChunksAppended < fillerChunks.size(); ++numFillerChunksAppended)
+			{
+				MsfzChunk& fillerChunkDesc = *fillerChunks[numFillerChunksAppended];
+				fillerChunkDesc.m_OffsetToChunkData = chunkDataWriter.Append(getChunkData(fillerChunkDesc));
+			}
+		}
+
+		std::unique_ptr<uint8_t[]> m_Data;
+		size_t m_Capacity = 0;
+		size_t m_UsedSize = 0;
+		std::vector<MsfzChunk> m_PendingChunks;
+	};
+
+	void CoalesceDataFromStream(const PDBInputFile& inputFile, const PDBStreamInfo& streamInfo, const uint32_t blockSize, ReadOnlyVector<uint8_t>& outStreamData)
+	{
+		const std::vector<uint32_t>& streamBlockIndices = streamInfo.m_StreamBlockIndices;
+		const uint32_t streamSize = streamInfo.m_StreamSize;
+		if (!inputFile.IsStreamed() && AreStreamBlocksContiguous(streamInfo))
+		{
+			const ImmutableStream pdbFileStream = inputFile.GetMappedStream();
+			const uint64_t streamOffset = static_cast<uint64_t>(blockSize) * streamBlockIndices.front();
+			if (!pdbFileStream.CanRead(streamOffset, streamSize))
+			{
+				ThrowError("Unable to read stream data from the input file. Offset: %llu, Size: %u", streamOffset, streamSize);
+			}
+			outStreamData.AssignNonOwned({ pdbFileStream.PeekAtOffset<uint8_t>(streamOffset), streamSize });
+			return;
+		}
+
+		// one copy per run of consecutive blocks
+		std::vector<uint8_t> streamData(streamSize);
+		StreamBlockReader blockReader(inputFile, streamInfo, blockSize, 0);
+		blockReader.ReadInto(streamData.data(), streamSize);
+		outStreamData.AssignOwned(streamData);
+	}
+
+	void ParseStreamDirectory(const PDBInputFile& inputFile, const PDBSuperBlock* pdbSuperblock, std::vector<PDBStreamInfo>& outStreams)
+	{
+		const uint32_t blockSize = pdbSuperblock->m_BlockSize;
+		const uint32_t directorySizeInBytes = pdbSuperblock->m_DirectorySize;
+
+		// read directory indices stream info
+		PDBStreamInfo directoryIndicesStreamInfo = {};
+		const uint32_t directoryBlockIndicesSize = AlignTo(directorySizeInBytes, blockSize) / blockSize;
+		const uint32_t directoryBlockIndicesByteSize = directoryBlockIndicesSize * sizeof(uint32_t);
+		const uint32_t directoryBlockIndicesStreamSize = AlignTo(directoryBlockIndicesByteSize, blockSize) / blockSize;
+		directoryIndicesStreamInfo.m_StreamSize = directoryBlockIndicesByteSize;
+		std::vector<uint32_t> directoryIndicesBlockIndices(directoryBlockIndicesStreamSize);
+		if (!inputFile.ReadBytes(sizeof(PDBSuperBlock), directoryIndicesBlockIndices.data(), directoryBlockIndicesStreamSize * sizeof(uint32_t)))
+		{
+			ThrowError("Unable to read directory block indices from the input file.");
+		}
+		SetStreamBlockIndices(directoryIndicesStreamInfo, std::move(directoryIndicesBlockIndices));
+
+		// get directory stream indices data
+		ReadOnlyVector<uint8_t> directoryIndicesData;
+		CoalesceDataFromStream(inputFile, directoryIndicesStreamInfo, blockSize, directoryIndicesData);
+		ImmutableStream directoryIndicesStream(directoryIndicesData.GetData(), directoryIndicesData.GetSize());
+
+		// read directory stream info
+		PDBStreamInfo directoryStreamInfo = {};
+		directoryStreamInfo.m_StreamSize = directorySizeInBytes;
+		std::vector<uint32_t> directoryBlockIndices(directoryBlockIndicesSize);
+		memcpy(directoryBlockIndices.data(), directoryIndicesData.GetData(), directoryBlockIndicesSize * sizeof(uint32_t));
+		SetStreamBlockIndices(directoryStreamInfo, std::move(directoryBlockIndices));
+
+		// finally, get the real directory stream data. mental.
+		ReadOnlyVector<uint8_t> directoryData;
+		CoalesceDataFromStream(inputFile, directoryStreamInfo, blockSize, directoryData);
+		ImmutableStream directoryStream(directoryData.GetData(), directoryData.GetSize());
+
+		// setup number of streams
+		const uint32_t* numStreamsPtr = directoryStream.PeekAtOffset<uint32_t>(0);
+		if (numStreamsPtr == nullptr)
+		{
+			ThrowError("Unable to read the count of MSF streams from the input file.");
+		}
+		const uint32_t numStreams = *numStreamsPtr;
+		outStreams.resize(numStreams);
+
+		// parse directory data
+		ImmutableStream streamSizesStream = directoryStream.GetStreamAtOffset(sizeof(uint32_t), sizeof(uint32_t) * numStreams);
+		ImmutableStream blockIndicesStream = directoryStream.GetStreamAtOffset(sizeof(uint32_t) + sizeof(uint32_t) * numStreams);
+		for (uint32_t streamIndex = 0; streamIndex < numStreams; ++streamIndex)
+		{
+			const uint32_t* streamSizePtr = streamSizesStream.Read<uint32_t>();
+			PDBStreamInfo& streamInfo = outStreams[streamIndex];
+			if (streamSizePtr == nullptr)
+			{
+				ThrowError("Unable to read size of the stream from the input file. Stream index: %u", streamIndex);
+			}
+			streamInfo.m_StreamSize = *streamSizePtr;
+
+			if (streamInfo.m_StreamSize == UINT32_MAX || streamInfo.m_StreamSize == 0)
+			{
+				streamInfo.m_StreamSize = 0;
+				continue;
+			}
+
+			std::vector<uint32_t> streamBlockIndices(AlignTo(streamInfo.m_StreamSize, blockSize) / blockSize);
+			if (!blockIndicesStream.ReadData(streamBlockIndices.data(), streamBlockIndices.size() * sizeof(uint32_t)))
+			{
+				ThrowError("Unable to read block indices from the input file.");
+			}
+			SetStreamBlockIndices(streamInfo, std::move(streamBlockIndices));
+		}
+	}
+
+	// reads the null terminated string at the stream's read offset, returns false if it isn't terminated within the stream
+	bool ReadNullTerminatedString(ImmutableStream& stream, std::string_view& outString)
+	{
+		const char* stringData = stream.Peek<char>();
+		const size_t maxStringLength = StrictCastTo<size_t>(stream.GetSize() - stream.GetOffset());
+		const char* stringEnd = stringData != nullptr ? static_cast<const char*>(memchr(stringData, '\0', maxStringLength)) : nullptr;
+		if (stringEnd == nullptr)
+		{
+			return false;
+		}
+		outString = std::string_view(stringData, stringEnd - stringData);
+		return stream.Seek(stream.GetOffset() + outString.size() + 1);
+	}
+
+	// the named stream map follows the PDB info stream header: a buffer of stream names, then a hash table of (name offset, stream index) pairs
+	template <typename SetStreamRoleFn>
+	void ParseNamedStreamMap(ImmutableStream& pdbInfoStream, SetStreamRoleFn&& setStreamRole)
+	{
+		constexpr uint64_t k_PdbInfoHeaderSize = 28u;	// version, signature, age and GUID
+		const uint32_t* stringBufferSize = pdbInfoStream.Seek(k_PdbInfoHeaderSize) ? pdbInfoStream.Read<uint32_t>() : nullptr;
+		if (stringBufferSize == nullptr || !pdbInfoStream.CanRead(*stringBufferSize))
+		{
+			return;
+		}
+		const ImmutableStream stringBufferStream = pdbInfoStream.GetStreamAtOffset(pdbInfoStream.GetOffset(), *stringBufferSize);
+		pdbInfoStream.Seek(pdbInfoStream.GetOffset() + *stringBufferSize);
+
+		const uint32_t* numEntries = pdbInfoStream.Read<uint32_t>();
+		const uint32_t* capacity = pdbInfoStream.Read<uint32_t>();
+		if (numEntries == nullptr || capacity == nullptr)
+		{
+			return;
+		}
+		// present and deleted bucket bit vectors, only the entries themselves are needed
+		for (uint32_t bitVectorIndex = 0; bitVectorIndex < 2; ++bitVectorIndex)
+		{
+			const uint32_t* numWords = pdbInfoStream.Read<uint32_t>();
+			if (numWords == nullptr || !pdbInfoStream.Seek(pdbInfoStream.GetOffset() + static_cast<uint64_t>(*numWords) * sizeof(uint32_t)))
+			{
+				return;
+			}
+		}
+		for (uint32_t entryIndex = 0; entryIndex < *numEntries; ++entryIndex)
+		{
+			const uint32_t* nameOffset = pdbInfoStream.Read<uint32_t>();
+			const uint32_t* streamIndex = pdbInfoStream.Read<uint32_t>();
+			if (nameOffset == nullptr || streamIndex == nullptr)
+			{
+				return;
+			}
+			ImmutableStream nameStream = stringBufferStream.GetStreamAtOffset(*nameOffset);
+			std::string_view streamName;
+			if (ReadNullTerminatedString(nameStream, streamName))
+			{
+				setStreamRole(*streamIndex, streamName == "/names" ? StreamRole::NamesStream : StreamRole::NamedStream);
+			}
+		}
+	}
+
+	// adds the part of the stream from beginOffset to endOffset as a record region, if it's within the stream
+	void AddRecordRegion(PDBStreamInfo& streamInfo, const uint64_t beginOffset, const uint64_t endOffset, const RecordFormat format)
+	{
+		if (beginOffset < endOffset && endOffset <= streamInfo.m_StreamSize)
+		{
+			streamInfo.m_RecordRegions.push_back({ StrictCastTo<uint32_t>(beginOffset), StrictCastTo<uint32_t>(endOffset), format });
+		}
+	}
+
+	// type records follow the TPI/IPI stream header. the index offset buffer in the hash stream lists the offsets of every few kilobytes worth of
+	// type records, relative to the first one, which lets the records in between be skipped when looking for a record boundary
+	void SetTypeStreamRecordRegions(const PDBInputFile& inputFile, const uint32_t blockSize, const PDBTypeStreamHeader& typeStreamHeader, std::vector<PDBStreamInfo>& inOutStreams, PDBStreamInfo& outTypeStreamInfo)
+	{
+		const uint64_t recordsBeginOffset = typeStreamHeader.m_HeaderSize;
+		const uint64_t recordsEndOffset = recordsBeginOffset + typeStreamHeader.m_TypeRecordBytes;
+		AddRecordRegion(outTypeStreamInfo, recordsBeginOffset, recordsEndOffset, RecordFormat::CodeViewRecords);
+		if (outTypeStreamInfo.m_RecordRegions.empty() || typeStreamHeader.m_HashStreamIndex >= inOutStreams.size() || typeStreamHeader.m_IndexOffsetBufferOffset < 0)
+		{
+			return;
+		}
+
+		struct TypeIndexOffset
+		{
+			uint32_t m_TypeIndex;
+			uint32_t m_Offset;
+		};
+		const PDBStreamInfo& hashStreamInfo = inOutStreams[typeStreamHeader.m_HashStreamIndex];
+		std::vector<TypeIndexOffset> indexOffsets(std::min(typeStreamHeader.m_IndexOffsetBufferLength, hashStreamInfo.m_StreamSize) / sizeof(TypeIndexOffset));
+		if (!ReadStreamBytes(inputFile, hashStreamInfo, blockSize, typeStreamHeader.m_IndexOffsetBufferOffset, indexOffsets.size() * sizeof(TypeIndexOffset), indexOffsets.data()))
+		{
+			return;
+		}
+		for (const TypeIndexOffset& indexOffset : indexOffsets)
+		{
+			const uint64_t recordOffset = recordsBeginOffset + indexOffset.m_Offset;
+			if (recordOffset < recordsEndOffset && (outTypeStreamInfo.m_RecordBoundaryHints.empty() || recordOffset > outTypeStreamInfo.m_RecordBoundaryHints.back()))
+			{
+				outTypeStreamInfo.m_RecordBoundaryHints.push_back(StrictCastTo<uint32_t>(recordOffset));
+			}
+		}
+	}
+
+	// a module stream holds the module's symbol records after a 4 byte signature, then C11 and C13 line info, then global references
+	void SetModuleStreamRecordRegions(const PDBModuleInfo& moduleInfo, PDBStreamInfo& outModuleStreamInfo)
+	{
+		const uint64_t symbolsEndOffset = moduleInfo.m_SymByteSize;
+		const uint64_t c13LinesBeginOffset = symbolsEndOffset + moduleInfo.m_C11ByteSize;
+		AddRecordRegion(outModuleStreamInfo, sizeof(uint32_t), symbolsEndOffset, RecordFormat::CodeViewRecords);
+		AddRecordRegion(outModuleStreamInfo, c13LinesBeginOffset, c13LinesBeginOffset + moduleInfo.m_C13ByteSize, RecordFormat::DebugSubsections);
+	}
+
+	// goes through the DBI stream substreams: module info, section contributions, section map, source info, type server map, EC and the optional debug header
+	template <typename SetStreamRoleFn>
+	void ParseDbiStream(const PDBInputFile& inputFile, const uint32_t blockSize, std::vector<PDBStreamInfo>& inOutStreams, SetStreamRoleFn&& setStreamRole)
+	{
+		const PDBStreamInfo& dbiStreamInfo = inOutStreams[g_DbiStreamIndex];
+		PDBDbiStreamHeader dbiHeader = {};
+		if (!ReadStreamBytes(inputFile, dbiStreamInfo, blockSize, 0, sizeof(PDBDbiStreamHeader), &dbiHeader))
+		{
+			return;
+		}
+		setStreamRole(dbiHeader.m_GlobalStreamIndex, StreamRole::GlobalsStream);
+		setStreamRole(dbiHeader.m_PublicStreamIndex, StreamRole::PublicsStream);
+		setStreamRole(dbiHeader.m_SymRecordStreamIndex, StreamRole::SymbolRecordsStream);
+
+		const int32_t substreamSizes[] = { dbiHeader.m_ModInfoSize, dbiHeader.m_SectionContributionSize, dbiHeader.m_SectionMapSize, dbiHeader.m_SourceInfoSize,
+			dbiHeader.m_TypeServerMapSize, dbiHeader.m_ECSubstreamSize, dbiHeader.m_OptionalDbgHeaderSize };
+		if (std::any_of(std::begin(substreamSizes), std::end(substreamSizes), [](const int32_t size) { return size < 0; }))
+		{
+			return;
+		}
+
+		// module info records, each of them names the stream holding the module's symbols and line info
+		if (sizeof(PDBDbiStreamHeader) + static_cast<uint64_t>(dbiHeader.m_ModInfoSize) > dbiStreamInfo.m_StreamSize)
+		{
+			return;
+		}
+		std::vector<uint8_t> moduleInfoData(dbiHeader.m_ModInfoSize);
+		if (!ReadStreamBytes(inputFile, dbiStreamInfo, blockSize, sizeof(PDBDbiStreamHeader), moduleInfoData.size(), moduleInfoData.data()))
+		{
+			return;
+		}
+		ImmutableStream moduleInfoStream(moduleInfoData.data(), moduleInfoData.size());
+		for (uint32_t moduleIndex = 0; const PDBModuleInfo* moduleInfo = moduleInfoStream.Read<PDBModuleInfo>(); ++moduleIndex)
+		{
+			setStreamRole(moduleInfo->m_ModuleSymStreamIndex, StreamRole::ModuleSymbolsStream);
+			if (moduleInfo->m_ModuleSymStreamIndex < inOutStreams.size())
+			{
+				PDBStreamInfo& moduleStreamInfo = inOutStreams[moduleInfo->m_ModuleSymStreamIndex];
+				if (moduleStreamInfo.m_Role == StreamRole::ModuleSymbolsStream && moduleStreamInfo.m_ModuleIndex == UINT32_MAX)
+				{
+					moduleStreamInfo.m_ModuleIndex = moduleIndex;
+					SetModuleStreamRecordRegions(*moduleInfo, moduleStreamInfo);
+				}
+			}
+
+			std::string_view moduleName;
+			std::string_view objectFileName;
+			if (!ReadNullTerminatedString(moduleInfoStream, moduleName) || !ReadNullTerminatedString(moduleInfoStream, objectFileName))
+			{
+				break;
+			}
+			moduleInfoStream.Seek(AlignTo(moduleInfoStream.GetOffset(), sizeof(uint32_t)));
+		}
+
+		// the section map has a fixed entry size, so it tells whether the substream sizes in the header can be trusted to find the debug header
+		const uint64_t sectionMapOffset = sizeof(PDBDbiStreamHeader) + static_cast<uint64_t>(dbiHeader.m_ModInfoSize) + dbiHeader.m_SectionContributionSize;
+		PDBSectionMapHeader sectionMapHeader = {};
+		if (dbiHeader.m_SectionMapSize != 0
+			&& (!ReadStreamBytes(inputFile, dbiStreamInfo, blockSize, sectionMapOffset, sizeof(PDBSectionMapHeader), &sectionMapHeader)
+				|| sizeof(PDBSectionMapHeader) + static_cast<uint64_t>(sectionMapHeader.m_Count) * g_SectionMapEntrySize != static_cast<uint64_t>(dbiHeader.m_SectionMapSize)))
+		{
+			return;
+		}
+
+		const uint64_t debugHeaderOffset = sectionMapOffset + dbiHeader.m_SectionMapSize + dbiHeader.m_SourceInfoSize + dbiHeader.m_TypeServerMapSize + dbiHeader.m_ECSubstreamSize;
+		uint16_t debugStreamIndices[g_MaxNumDbiDebugStreams] = {};
+		const uint32_t numDebugStreams = std::min(g_MaxNumDbiDebugStreams, StrictCastTo<uint32_t>(dbiHeader.m_OptionalDbgHeaderSize / sizeof(uint16_t)));
+		if (ReadStreamBytes(inputFile, dbiStreamInfo, blockSize, debugHeaderOffset, numDebugStreams * sizeof(uint16_t), debugStreamIndices))
+		{
+			for (uint32_t debugStreamIndex = 0; debugStreamIndex < numDebugStreams; ++debugStreamIndex)
+			{
+				setStreamRole(debugStreamIndices[debugStreamIndex], StreamRole::DebugDataStream);
+			}
+		}
+	}
+
+	// Labels each stream with its role, based on the fixed stream indices, the PDB info stream's named stream map and the stream indices found in
+	// the TPI, IPI and DBI streams, and finds the parts of the type and module streams made of records. PDBs don't have to contain all of these
+	// streams, and anything that can't be parsed is just left unknown.
+	void ClassifyStreams(const PDBInputFile& inputFile, const uint32_t blockSize, std::vector<PDBStreamInfo>& inOutStreams)
+	{
+		// the first role found for a stream sticks, so that a bogus index in one header can't relabel the fixed streams
+		const auto setStreamRole = [&inOutStreams](const uint32_t streamIndex, const StreamRole role)
+			{
+				if (streamIndex != g_InvalidStreamIndex && streamIndex < inOutStreams.size() && inOutStreams[streamIndex].m_Role == StreamRole::UnknownStream)
+				{
+					inOutStreams[streamIndex].m_Role = role;
+				}
+			};
+
+		setStreamRole(0, StreamRole::OldDirectoryStream);
+		setStreamRole(g_PdbInfoStreamIndex, StreamRole::PdbInfoStream);
+		setStreamRole(g_TpiStreamIndex, StreamRole::TpiStream);
+		setStreamRole(g_DbiStreamIndex, StreamRole::DbiStream);
+		setStreamRole(g_IpiStreamIndex, StreamRole::IpiStream);
+
+		if (g_PdbInfoStreamIndex < inOutStreams.size())
+		{
+			ReadOnlyVector<uint8_t> pdbInfoStreamData;
+			CoalesceDataFromStream(inputFile, inOutStreams[g_PdbInfoStreamIndex], blockSize, pdbInfoStreamData);
+			ImmutableStream pdbInfoStream(pdbInfoStreamData.GetData(), pdbInfoStreamData.GetSize());
+			ParseNamedStreamMap(pdbInfoStream, setStreamRole);
+		}
+
+		for (const auto& [typeStreamIndex, hashStreamRole] : { std::pair{ g_TpiStreamIndex, StreamRole::TpiHashStream }, std::pair{ g_IpiStreamIndex, StreamRole::IpiHashStream } })
+		{
+			PDBTypeStreamHeader typeStreamHeader = {};
+			if (typeStreamIndex < inOutStreams.size() && ReadStreamBytes(inputFile, inOutStreams[typeStreamIndex], blockSize, 0, sizeof(PDBTypeStreamHeader), &typeStreamHeader))
+			{
+				setStreamRole(typeStreamHeader.m_HashStreamIndex, hashStreamRole);
+				setStreamRole(typeStreamHeader.m_HashAuxStreamIndex, hashStreamRole);
+				SetTypeStreamRecordRegions(inputFile, blockSize, typeStreamHeader, inOutStreams, inOutStreams[typeStreamIndex]);
+			}
+		}
+
+		if (g_DbiStreamIndex < inOutStreams.size())
+		{
+			ParseDbiStream(inputFile, blockSize, inOutStreams, setStreamRole);
+		}
+	}
+
+	// A compression policy rule. It applies to the streams that match all of its criteria, and overrides the settings it has values for.
+	struct CompressionPolicyRule
+	{
+		std::vector<StreamRole> m_Roles;	// any role if empty
+		uint32_t m_FirstStreamIndex = 0;
+		uint32_t m_LastStreamIndex = UINT32_MAX;
+		uint32_t m_MinStreamSize = 0;
+		uint32_t m_MaxStreamSize = UINT32_MAX;
+
+		std::optional<CompressionStrategy> m_Strategy;
+		std::optional<uint32_t> m_Level;
+		std::optional<uint32_t> m_FixedFragmentSize;
+		std::optional<uint32_t> m_MaxFragmentsPerStream;
+		std::optional<bool> m_AlignFragmentsToRecords;
+		std::optional<uint32_t> m_RawChunkThreshold;
+	};
+
+	struct CompressionPolicyPreset
+	{
+		const char* m_Name;
+		const char* m_Rules;
+	};
+
+	// built-in policies, in the same syntax as policy files, see ParseCompressionPolicy()
+	constexpr CompressionPolicyPreset k_CompressionPolicyPresets[] =
+	{
+		{
+			"fast-load",
+			// streams that are looked up record by record get small fragments cut between records, so that a lookup decompresses little more
+			// than the record itself. streams that debuggers read as a whole when opening the PDB stay in one piece, and streams that are
+			// too small to gain anything from compression are stored as they are.
+			"strategy=MultiFragment fragment_size=16384 align_to_records=1\n"
+			"role=PdbInfo,Dbi,TpiHash,IpiHash,Globals,Publics,Names,Named,DebugData strategy=SingleFragment\n"
+			"max_size=256 strategy=NoCompression\n"
+		},
+		{
+			"archive",
+			// the best ratio for every stream, with huge streams still cut into large fragments so that reading a part of them stays cheap
+			"strategy=SingleFragment level=19\n"
+			"min_size=0x4000000 strategy=MultiFragment fragment_size=0x400000\n"
+		},
+	};
+
+	bool ParsePolicyNumber(const std::string_view& text, uint32_t& outValue)
+	{
+		const std::string numberText(text);
+		char* numberEnd = nullptr;
+		const int numberBase = numberText.starts_with("0x") ? 16 : 10;
+		const unsigned long long value = strtoull(numberText.c_str(), &numberEnd, numberBase);
+		if (numberText.empty() || numberText.front() == '-' || *numberEnd != '\0' || value > UINT32_MAX)
+		{
+			return false;
+		}
+		outValue = static_cast<uint32_t>(value);
+		return true;
+	}
+
+	// Parses a compression policy. Every line is a rule made of whitespace separated key=value pairs, and everything after a '#' is a comment.
+	// Keys that select streams:
+	//   role=Tpi,Ipi,...   stream roles, as listed by --stats
+	//   index=N or N-M     stream index or inclusive range of stream indices
+	//   min_size=N         streams of at least N bytes
+	//   max_size=N         streams of at most N bytes
+	// Keys that set how the selected streams get compressed, the same as the command line arguments of the same name:
+	//   strategy=NoCompression|SingleFragment|MultiFragment, level=1-22, fragment_size=N, max_frps=N, align_to_records=0|1, raw_chunk_threshold=1-100
+	// Rules are applied in order, so later rules override earlier ones for the streams they select.
+	void ParseCompressionPolicy(const std::string_view& policyText, const char* policyName, std::vector<CompressionPolicyRule>& outRules)
+	{
+		uint32_t lineNumber = 0;
+		for (size_t lineBegin = 0; lineBegin < policyText.size();)
+		{
+			const size_t lineEnd = std::min(policyText.find('\n', lineBegin), policyText.size());
+			std::string_view line = policyText.substr(lineBegin, lineEnd - lineBegin);
+			line = line.substr(0, line.find('#'));
+			lineBegin = lineEnd + 1;
+			++lineNumber;
+
+			const auto throwPolicyError = [policyName, lineNumber](const char* message, const std::string_view& token)
+				{
+					ThrowError("Invalid compression policy %s, line %u: %s '%.*s'", policyName, lineNumber, message, static_cast<int>(token.size()), token.data());
+				};
+
+			CompressionPolicyRule rule;
+			bool isRuleEmpty = true;
+			for (size_t tokenBegin = line.find_first_not_of(" \t\r"); tokenBegin != std::string_view::npos; tokenBegin = line.find_first_not_of(" \t\r", tokenBegin))
+			{
+				const size_t tokenEnd = std::min(line.find_first_of(" \t\r", tokenBegin), line.size());
+				const std::string_view token = line.substr(tokenBegin, tokenEnd - tokenBegin);
+				tokenBegin = tokenEnd;
+
+				const size_t separator = token.find('=');
+				if (separator == std::string_view::npos)
+				{
+					throwPolicyError("expected key=value, got", token);
+				}
+				const std::string_view key = token.substr(0, separator);
+				const std::string_view value = token.substr(separator + 1);
+				uint32_t number = 0;
+				if (key == "role")
+				{
+					for (size_t roleBegin = 0; roleBegin <= value.size();)
+					{
+						const size_t roleEnd = std::min(value.find(',', roleBegin), value.size());
+						const std::string_view roleName = value.substr(roleBegin, roleEnd - roleBegin);
+						const auto roleNameIt = std::find(std::begin(g_StreamRoleNames), std::end(g_StreamRoleNames), roleName);
+						if (roleNameIt == std::end(g_StreamRoleNames))
+						{
+							throwPolicyError("unknown stream role", roleName);
+						}
+						rule.m_Roles.push_back(static_cast<StreamRole>(roleNameIt - std::begin(g_StreamRoleNames)));
+						roleBegin = roleEnd + 1;
+					}
+				}
+				else if (key == "index")
+				{
+					const size_t rangeSeparator = value.find('-');
+					const std::string_view lastIndexText = rangeSeparator != std::string_view::npos ? value.substr(rangeSeparator + 1) : value;
+					if (!ParsePolicyNumber(value.substr(0, rangeSeparator), rule.m_FirstStreamIndex) || !ParsePolicyNumber(lastIndexText, rule.m_LastStreamIndex)
+						|| rule.m_FirstStreamIndex > rule.m_LastStreamIndex)
+					{
+						throwPolicyError("invalid stream index range", value);
+					}
+				}
+				else if (key == "min_size" || key == "max_size")
+				{
+					if (!ParsePolicyNumber(value, key == "min_size" ? rule.m_MinStreamSize : rule.m_MaxStreamSize))
+					{
+						throwPolicyError("invalid stream size", value);
+					}
+				}
+				else if (key == "strategy")
+				{
+					if (value == "NoCompression")
+					{
+						rule.m_Strategy = CompressionStrategy::NoCompression;
+					}
+					else if (value == "SingleFragment")
+					{
+						rule.m_Strategy = CompressionStrategy::SingleFragment;
+					}
+					else if (value == "MultiFragment")
+					{
+						rule.m_Strategy = CompressionStrategy::MultiFragment;
+					}
+					else
+					{
+						throwPolicyError("unknown compression strategy", value);
+					}
+				}
+				else if (key == "level")
+				{
+					if (!ParsePolicyNumber(value, number) || number < 1 || number > 22)
+					{
+						throwPolicyError("compression level must be 1-22, got", value);
+					}
+					rule.m_Level = number;
+				}
+				else if (key == "fragment_size")
+				{
+					if (!ParsePolicyNumber(value, number) || number == 0)
+					{
+						throwPolicyError("invalid fragment size", value);
+					}
+					rule.m_FixedFragmentSize = number;
+				}
+				else if (key == "max_frps")
+				{
+					if (!ParsePolicyNumber(value, number) || number < 2)
+					{
+						throwPolicyError("max frps must be at least 2, got", value);
+					}
+					rule.m_MaxFragmentsPerStream = number;
+				}
+				else if (key == "align_to_records")
+				{
+					if (value != "0" && value != "1")
+					{
+						throwPolicyError("align_to_records must be 0 or 1, got", value);
+					}
+					rule.m_AlignFragmentsToRecords = value == "1";
+				}
+				else if (key == "raw_chunk_threshold")
+				{
+					if (!ParsePolicyNumber(value, number) || number < 1 || number > 100)
+					{
+						throwPolicyError("raw chunk threshold must be 1-100, got", value);
+					}
+					rule.m_RawChunkThreshold = number;
+				}
+				else
+				{
+					throwPolicyError("unknown key", key);
+				}
+				isRuleEmpty = false;
+			}
+
+			if (!isRuleEmpty)
+			{
+				outRules.push_back(std::move(rule));
+			}
+		}
+	}
+
+	// the policy is either the name of a built-in preset or the path to a policy file
+	void LoadCompressionPolicy(const std::string& policy, std::vector<CompressionPolicyRule>& outRules)
+	{
+		LogScoped("Loading compression policy");
+
+		for (const CompressionPolicyPreset& preset : k_CompressionPolicyPresets)
+		{
+			if (policy == preset.m_Name)
+			{
+				ParseCompressionPolicy(preset.m_Rules, preset.m_Name, outRules);
+				return;
+			}
+		}
+
+		std::ifstream policyFile(policy, std::ios::binary);
+		if (!policyFile)
+		{
+			ThrowError("Unable to open the compression policy file %s.", policy.c_str());
+		}
+		const std::string policyText((std::istreambuf_iterator<char>(policyFile)), std::istreambuf_iterator<char>());
+		ParseCompressionPolicy(policyText, policy.c_str(), outRules);
+	}
+
+	bool DoesPolicyRuleMatchStream(const CompressionPolicyRule& rule, const uint32_t streamIndex, const PDBStreamInfo& streamInfo)
+	{
+		return (rule.m_Roles.empty() || std::find(rule.m_Roles.begin(), rule.m_Roles.end(), streamInfo.m_Role) != rule.m_Roles.end())
+			&& streamIndex >= rule.m_FirstStreamIndex && streamIndex <= rule.m_LastStreamIndex
+			&& streamInfo.m_StreamSize >= rule.m_MinStreamSize && streamInfo.m_StreamSize <= rule.m_MaxStreamSize;
+	}
+
+	// starts every stream off with the compression arguments and applies the policy rules that match it on top of them
+	void ResolveStreamCompressionSettings(const ProgramCommandLineArgs& args, const std::span<const CompressionPolicyRule>& policyRules, std::vector<PDBStreamInfo>& inOutStreams)
+	{
+		StreamCompressionSettings defaultSettings;
+		defaultSettings.m_Strategy = args.m_CompressionStrategy.value();
+		defaultSettings.m_Level = args.m_CompressionLevel.value_or(defaultSettings.m_Level);
+		defaultSettings.m_FixedFragmentSize = args.m_FixedFragmentSize.value_or(defaultSettings.m_FixedFragmentSize);
+		defaultSettings.m_MaxFragmentsPerStream = args.m_MaxFragmentsPerStream.value_or(defaultSettings.m_MaxFragmentsPerStream);
+		defaultSettings.m_AlignFragmentsToRecords = args.m_AlignFragmentsToRecords;
+		defaultSettings.m_RawChunkThreshold = args.m_RawChunkThreshold.value_or(defaultSettings.m_RawChunkThreshold);
+
+		for (uint32_t streamIndex = 0; streamIndex < inOutStreams.size(); ++streamIndex)
+		{
+			StreamCompressionSettings& settings = inOutStreams[streamIndex].m_CompressionSettings;
+			settings = defaultSettings;
+			for (const CompressionPolicyRule& rule : policyRules)
+			{
+				if (DoesPolicyRuleMatchStream(rule, streamIndex, inOutStreams[streamIndex]))
+				{
+					settings.m_Strategy = rule.m_Strategy.value_or(settings.m_Strategy);
+					settings.m_Level = rule.m_Level.value_or(settings.m_Level);
+					settings.m_FixedFragmentSize = rule.m_FixedFragmentSize.value_or(settings.m_FixedFragmentSize);
+					settings.m_MaxFragmentsPerStream = rule.m_MaxFragmentsPerStream.value_or(settings.m_MaxFragmentsPerStream);
+					settings.m_AlignFragmentsToRecords = rule.m_AlignFragmentsToRecords.value_or(settings.m_AlignFragmentsToRecords);
+					settings.m_RawChunkThreshold = rule.m_RawChunkThreshold.value_or(settings.m_RawChunkThreshold);
+				}
+			}
+		}
+	}
+
+	// One zstd compression context per worker thread, created once per job, so that compressing a fragment doesn't allocate and
+	// initialize a fresh context like one-shot ZSTD_compress does. The parameters are set per fragment, which zstd applies when the next frame starts.
+	class CompressionContextPool
+	{
+	public:
+		// fragments at least this large are split between zstd's own worker threads, so that a single huge fragment (e.g. a large stream
+		// compressed with SingleFragment) doesn't keep one thread busy long after all other fragments are done.
+		// zstd produces the same output for any number of its workers >= 1, so this depends on the fragment size only, never on the thread count.
+		static constexpr uint32_t k_MinFragmentSizeForZstdWorkers = 16u << 20;
+
+		// The calling worker's compression context, set up for one fragment. zstd worker threads for a large fragment are borrowed from a budget
+		// shared by all workers and go back to it once the lease ends, which for a temporary passed straight to a compress call is right after it.
+		class Lease
+		{
+		public:
+			Lease(const CompressionContextPool& pool, ZSTD_CCtx* compressionContext, const uint32_t numZstdWorkers)
+				: m_Pool(pool)
+				, m_CompressionContext(compressionContext)
+				, m_NumZstdWorkers(numZstdWorkers)
+			{
+			}
+
+			~Lease()
+			{
+				if (m_NumZstdWorkers != 0)
+				{
+					m_Pool.ReturnZstdWorkers(m_NumZstdWorkers);
+				}
+			}
+
+			Lease(const Lease&) = delete;
+			Lease& operator=(const Lease&) = delete;
+
+			operator ZSTD_CCtx*() const { return m_CompressionContext; }
+
+		private:
+			const CompressionContextPool& m_Pool;
+			ZSTD_CCtx* m_CompressionContext;
+			uint32_t m_NumZstdWorkers;
+		};
+
+		CompressionContextPool(const uint32_t numWorkers)
+			: m_NumZstdWorkers(std::max(1u, numWorkers))
+			, m_NumFreeZstdWorkers(static_cast<int32_t>(m_NumZstdWorkers))
+		{
+			m_Contexts.reserve(numWorkers);
+			for (uint32_t i = 0; i < numWorkers; ++i)
+			{
+				m_Contexts.emplace_back(nullptr, &ZSTD_freeCCtx);
+			}
+		}
+
+		// each worker creates its context on first use, so that it's allocated on the worker's NUMA node when workers are pinned
+		Lease GetForCurrentWorker(const uint32_t fragmentSize, const uint32_t compressionLevel) const
+		{
+			std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)>& workerContext = m_Contexts[WorkerThread::GetIndex()];
+			if (workerContext == nullptr)
+			{
+				workerContext.reset(ZSTD_createCCtx());
+				if (workerContext == nullptr)
+				{
+					ThrowError("Unable to create a compression context.");
+				}
+			}
+			ZSTD_CCtx* compressionContext = workerContext.get();
+			const uint32_t numZstdWorkers = fragmentSize >= k_MinFragmentSizeForZstdWorkers ? BorrowZstdWorkers() : 0u;
+			ZSTD_CCtx_setParameter(compressionContext, ZSTD_c_compressionLevel, compressionLevel);
+			// fails without ZSTD_MULTITHREAD, in which case zstd just keeps compressing on the calling thread
+			ZSTD_CCtx_setParameter(compressionContext, ZSTD_c_nbWorkers, numZstdWorkers);
+			return Lease(*this, compressionContext, numZstdWorkers);
+		}
+
+		// memory held by the calling worker's context, which grows with the compression level and the largest fragment it has compressed
+		size_t GetCurrentWorkerMemoryUsage() const
+		{
+			return ZSTD_sizeof_CCtx(m_Contexts[WorkerThread::GetIndex()].get());
+		}
+
+	private:
+		// There are as many zstd workers in total as there are pool workers, split evenly between the large fragments that are being compressed.
+		// Once they're all taken, a large fragment still gets one, as zstd's output with no workers differs from the output with any number of
+		// them. Its pool worker just waits for that one meanwhile, so compressing it doesn't take more than one core.
+		uint32_t BorrowZstdWorkers() const
+		{
+			std::lock_guard<std::mutex> lock(m_ZstdWorkersMutex);
+			++m_NumLargeFragmentsInFlight;
+			const int32_t fairShare = static_cast<int32_t>(m_NumZstdWorkers / m_NumLargeFragmentsInFlight);
+			const uint32_t numZstdWorkers = static_cast<uint32_t>(std::max(1, std::min(m_NumFreeZstdWorkers, fairShare)));
+			m_NumFreeZstdWorkers -= static_cast<int32_t>(numZstdWorkers);
+			return numZstdWorkers;
+		}
+
+		void ReturnZstdWorkers(const uint32_t numZstdWorkers) const
+		{
+			std::lock_guard<std::mutex> lock(m_ZstdWorkersMutex);
+			--m_NumLargeFragmentsInFlight;
+			m_NumFreeZstdWorkers += static_cast<int32_t>(numZstdWorkers);
+		}
+
+		mutable std::vector<std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)>> m_Contexts;	// only ever touched by the worker they belong to
+		const uint32_t m_NumZstdWorkers;
+		mutable std::mutex m_ZstdWorkersMutex;
+		mutable int32_t m_NumFreeZstdWorkers;	// goes below 0 while large fragments run on the one worker they always get
+		mutable uint32_t m_NumLargeFragmentsInFlight = 0;
+	};
+
+	// A range of consecutive fragments of one stream. Streams are cut into ranges of about k_TargetNumBytes, so that the fragments
+	// of one large stream are compressed by all worker threads rather than leaving a single thread with most of the file.
+	struct FragmentRangeTask
+	{
+		static constexpr uint64_t k_TargetNumBytes = 1u << 20;
+
+		uint32_t m_StreamIndex = 0;
+		uint32_t m_FirstFragmentIndex = 0;
+		uint32_t m_NumFragments = 0;
+		uint32_t m_StreamOffset = 0;	// where the range's first fragment begins in the stream
+		uint32_t m_NumBytes = 0;
+		uint32_t m_FirstChunkIndex = 0;	// index of the chunk holding the range's first fragment, one chunk per fragment
+		std::vector<uint32_t> m_PackedStreamIndices = {};	// streams sharing the range's single chunk, one fragment each, empty unless the chunk is packed
+
+		bool IsPacked() const { return !m_PackedStreamIndices.empty(); }
+	};
+
+	// Cuts a stream into fragments of GetFragmentSizeForStream() bytes. When fragments are aligned to records, each cut is moved to the record
+	// boundary closest to it instead, so that reading a record never takes more than one fragment, unless the record is larger than a fragment.
+	void SplitStreamIntoFragments(const PDBInputFile& inputFile, const PDBStreamInfo& streamInfo, const uint32_t blockSize, std::vector<MsfzFragment>& outFragments)
+	{
+		const StreamCompressionSettings& compressionSettings = streamInfo.m_CompressionSettings;
+		const uint32_t streamSize = streamInfo.m_StreamSize;
+		const uint32_t fragmentSize = GetFragmentSizeForStream(streamInfo);
+		const bool isMultiFragment = compressionSettings.m_Strategy == CompressionStrategy::MultiFragment;
+		const uint32_t maxNumFragments = isMultiFragment ? compressionSettings.m_MaxFragmentsPerStream : 1u;
+
+		std::optional<RecordWalker> recordWalker;
+		if (isMultiFragment && compressionSettings.m_AlignFragmentsToRecords && !streamInfo.m_RecordRegions.empty())
+		{
+			recordWalker.emplace(inputFile, streamInfo, blockSize);
+		}
+
+		for (uint32_t fragmentBegin = 0; fragmentBegin < streamSize;)
+		{
+			// with cuts moved around, the last fragment that's still allowed takes whatever is left of the stream
+			uint32_t fragmentEnd = streamSize;
+			if (streamSize - fragmentBegin > fragmentSize && outFragments.size() + 1 < maxNumFragments)
+			{
+				fragmentEnd = fragmentBegin + fragmentSize;
+				if (recordWalker)
+				{
+					fragmentEnd = recordWalker->FindClosestBoundary(fragmentBegin, fragmentEnd);
+				}
+			}
+
+			MsfzFragment& fragment = outFragments.emplace_back();
+			fragment.m_DataSize = fragmentEnd - fragmentBegin;
+			fragment.m_DataOffset = 0;
+			fragmentBegin = fragmentEnd;
+		}
+	}
+
+	void SplitStreamsIntoFragmentRanges(const PDBInputFile& inputFile,
+		const std::span<const PDBStreamInfo>& streamInfos,
+		const uint32_t blockSize,
+		std::vector<MsfzStream>& outStreamDescs,
+		std::vector<FragmentRangeTask>& outTasks)
+	{
+		for (uint32_t streamIndex = 0; streamIndex < streamInfos.size(); ++streamIndex)
+		{
+			std::vector<MsfzFragment>& fragments = outStreamDescs[streamIndex].m_Fragments;
+			SplitStreamIntoFragments(inputFile, streamInfos[streamIndex], blockSize, fragments);
+
+			uint32_t streamOffset = 0;
+			for (uint32_t fragmentIndex = 0; fragmentIndex < fragments.size(); ++fragmentIndex)
+			{
+				if (fragmentIndex == 0 || outTasks.back().m_NumBytes >= FragmentRangeTask::k_TargetNumBytes)
+				{
+					outTasks.push_back({ .m_StreamIndex = streamIndex, .m_FirstFragmentIndex = fragmentIndex, .m_StreamOffset = streamOffset });
+				}
+				FragmentRangeTask& task = outTasks.back();
+				++task.m_NumFragments;
+				task.m_NumBytes += fragments[fragmentIndex].m_DataSize;
+				streamOffset += fragments[fragmentIndex].m_DataSize;
+			}
+		}
+	}
+
+	// Streams of at most maxRawStreamSize bytes are stored as they are, as a single fragment outside of any chunk. For streams that small, a chunk
+	// descriptor and a zstd frame cost about as much as the stream itself, and reading them takes neither a decompression nor a chunk lookup.
+	void KeepTinyStreamsOutOfChunks(const std::span<const PDBStreamInfo>& streamInfos,
+		const uint32_t maxRawStreamSize,
+		std::vector<MsfzStream>& inOutStreamDescs,
+		std::vector<FragmentRangeTask>& inOutTasks)
+	{
+		const auto isRawStream = [&streamInfos, maxRawStreamSize](const uint32_t streamIndex)
+			{
+				return streamInfos[streamIndex].m_StreamSize <= maxRawStreamSize;
+			};
+		for (uint32_t streamIndex = 0; streamIndex < streamInfos.size(); ++streamIndex)
+		{
+			if (streamInfos[streamIndex].m_StreamSize != 0 && isRawStream(streamIndex))
+			{
+				inOutStreamDescs[streamIndex].m_Fragments.assign(1, MsfzFragment{ streamInfos[streamIndex].m_StreamSize, 0, 0 });
+			}
+		}
+		std::erase_if(inOutTasks, [&isRawStream](const FragmentRangeTask& task) { return isRawStream(task.m_StreamIndex); });
+	}
+
+	// raw fragments point straight at their data in the file, which all goes in one region, in stream order
+	void AssignRawFragmentOffsets(const uint64_t rawStreamDataOffset, std::vector<MsfzStream>& inOutStreamDescs)
+	{
+		uint64_t dataOffset = rawStreamDataOffset;
+		for (MsfzStream& streamDesc : inOutStreamDescs)
+		{
+			for (MsfzFragment& fragment : streamDesc.m_Fragments)
+			{
+				if (!fragment.IsLocatedInChunk())
+				{
+					fragment.m_DataOffset = StrictCastTo<uint32_t>(dataOffset);
+					dataOffset += fragment.m_DataSize;
+				}
+			}
+		}
+	}
+
+	// Streams that fit in a single fragment smaller than the target chunk size share chunks of up to that size rather than taking a chunk each,
+	// which saves a zstd frame, a chunk descriptor and a decompression per stream. A chunk is only shared by streams of the same role that are
+	// compressed the same way. Module symbol streams are packed in the order of their modules, all other streams in stream order, so that
+	// streams that tend to be read together end up in the same chunk. Each packed chunk takes the place of the first stream packed into it.
+	void PackSmallStreamsIntoSharedChunks(const std::span<const PDBStreamInfo>& streamInfos,
+		const std::span<const MsfzStream>& streamDescs,
+		const uint32_t targetChunkSize,
+		std::vector<FragmentRangeTask>& inOutTasks)
+	{
+		const auto getPackingGroup = [&streamInfos](const uint32_t streamIndex)
+			{
+				const StreamCompressionSettings& compressionSettings = streamInfos[streamIndex].m_CompressionSettings;
+				const bool isCompressed = compressionSettings.m_Strategy != CompressionStrategy::NoCompression;
+				return std::tuple(streamInfos[streamIndex].m_Role, isCompressed, isCompressed ? compressionSettings.m_Level : 0u);
+			};
+
+		std::vector<uint32_t> packableStreamIndices;
+		for (const FragmentRangeTask& task : inOutTasks)
+		{
+			if (streamDescs[task.m_StreamIndex].m_Fragments.size() == 1 && task.m_NumBytes < targetChunkSize)
+			{
+				packableStreamIndices.push_back(task.m_StreamIndex);
+			}
+		}
+		// ties keep the stream order
+		std::stable_sort(packableStreamIndices.begin(), packableStreamIndices.end(), [&streamInfos, &getPackingGroup](const uint32_t lhs, const uint32_t rhs)
+			{
+				return std::tuple(getPackingGroup(lhs), streamInfos[lhs].m_ModuleIndex) < std::tuple(getPackingGroup(rhs), streamInfos[rhs].m_ModuleIndex);
+			});
+
+		std::vector<bool> isStreamPacked(streamInfos.size());
+		std::vector<FragmentRangeTask> packedTasks;
+		for (size_t firstIndex = 0; firstIndex < packableStreamIndices.size();)
+		{
+			const uint32_t firstStreamIndex = packableStreamIndices[firstIndex];
+			uint64_t numBytes = streamInfos[firstStreamIndex].m_StreamSize;
+			size_t endIndex = firstIndex + 1;
+			for (; endIndex < packableStreamIndices.size(); ++endIndex)
+			{
+				const uint32_t streamIndex = packableStreamIndices[endIndex];
+				if (getPackingGroup(streamIndex) != getPackingGroup(firstStreamIndex) || numBytes + streamInfos[streamIndex].m_StreamSize > targetChunkSize)
+				{
+					break;
+				}
+				numBytes += streamInfos[streamIndex].m_StreamSize;
+			}
+
+			// a stream with nothing to share its chunk with keeps its own
+			if (endIndex - firstIndex > 1)
+			{
+				FragmentRangeTask& packedTask = packedTasks.emplace_back();
+				packedTask.m_StreamIndex = firstStreamIndex;
+				packedTask.m_NumFragments = 1;
+				packedTask.m_NumBytes = StrictCastTo<uint32_t>(numBytes);
+				packedTask.m_PackedStreamIndices.assign(packableStreamIndices.begin() + firstIndex, packableStreamIndices.begin() + endIndex);
+				for (const uint32_t streamIndex : packedTask.m_PackedStreamIndices)
+				{
+					isStreamPacked[streamIndex] = true;
+				}
+			}
+			firstIndex = endIndex;
+		}
+
+		// the packed streams' own ranges are replaced by the packed chunks
+		std::erase_if(inOutTasks, [&isStreamPacked](const FragmentRangeTask& task) { return isStreamPacked[task.m_StreamIndex]; });
+		inOutTasks.insert(inOutTasks.end(), std::make_move_iterator(packedTasks.begin()), std::make_move_iterator(packedTasks.end()));
+		std::stable_sort(inOutTasks.begin(), inOutTasks.end(), [](const FragmentRangeTask& lhs, const FragmentRangeTask& rhs) { return lhs.m_StreamIndex < rhs.m_StreamIndex; });
+	}
+
+	// The order in which debuggers read the streams when opening a PDB, streams that aren't read upfront go last
+	enum LoadPriority : uint8_t
+	{
+		PdbInfo,
+		Dbi,
+		TypeHeaders,
+		TypeHashes,
+		PublicsAndGlobals,
+		NotLoadedUpfront
+	};
+
+	LoadPriority GetLoadPriority(const StreamRole role)
+	{
+		switch (role)
+		{
+		case StreamRole::PdbInfoStream:
+			return LoadPriority::PdbInfo;
+		case StreamRole::DbiStream:
+			return LoadPriority::Dbi;
+		case StreamRole::TpiStream:
+		case StreamRole::IpiStream:
+			return LoadPriority::TypeHeaders;
+		case StreamRole::TpiHashStream:
+		case StreamRole::IpiHashStream:
+			return LoadPriority::TypeHashes;
+		case StreamRole::GlobalsStream:
+		case StreamRole::PublicsStream:
+			return LoadPriority::PublicsAndGlobals;
+		default:
+			return LoadPriority::NotLoadedUpfront;
+		}
+	}
+
+	// reorders the ranges so that the data that's read when a PDB is opened comes first, in the order it's read. The DBI stream is read as a whole
+	// (module info, section contributions, section map, debug header), but for the TPI and IPI streams only the range holding the stream header
+	// is read upfront, the type records are read on demand. the relative order of ranges with the same priority is kept, so everything that's not
+	// read upfront still follows the stream order.
+	void OrderFragmentRangesForLoading(const std::span<const PDBStreamInfo>& streamInfos, std::vector<FragmentRangeTask>& inOutTasks)
+	{
+		const auto getRangePriority = [&streamInfos](const FragmentRangeTask& task) -> LoadPriority
+			{
+				const LoadPriority streamPriority = GetLoadPriority(streamInfos[task.m_StreamIndex].m_Role);
+				return streamPriority == LoadPriority::TypeHeaders && task.m_FirstFragmentIndex != 0 ? LoadPriority::NotLoadedUpfront : streamPriority;
+			};
+		std::stable_sort(inOutTasks.begin(), inOutTasks.end(), [&getRangePriority](const FragmentRangeTask& lhs, const FragmentRangeTask& rhs)
+			{
+				return getRangePriority(lhs) < getRangePriority(rhs);
+			});
+	}
+
+	// chunks are laid out in the order of the ranges, so the chunk indices are known before anything gets compressed
+	uint32_t AssignChunkIndices(std::vector<FragmentRangeTask>& inOutTasks, std::vector<MsfzStream>& inOutStreamDescs)
+	{
+		uint32_t numChunks = 0;
+		for (FragmentRangeTask& task : inOutTasks)
+		{
+			task.m_FirstChunkIndex = numChunks;
+			if (task.IsPacked())
+			{
+				// the packed streams follow each other in the chunk, in the order they were packed in
+				uint32_t offsetInChunk = 0;
+				for (const uint32_t streamIndex : task.m_PackedStreamIndices)
+				{
+					MsfzFragment& fragment = inOutStreamDescs[streamIndex].m_Fragments.front();
+					fragment.SetChunkIndex(numChunks);
+					fragment.m_DataOffset = offsetInChunk;
+					offsetInChunk += fragment.m_DataSize;
+				}
+				++numChunks;
+				continue;
+			}
+			std::vector<MsfzFragment>& fragments = inOutStreamDescs[task.m_StreamIndex].m_Fragments;
+			for (uint32_t fragmentIndex = task.m_FirstFragmentIndex; fragmentIndex < task.m_FirstFragmentIndex + task.m_NumFragments; ++fragmentIndex)
+			{
+				fragments[fragmentIndex].SetChunkIndex(numChunks++);
+			}
+		}
+		return numChunks;
+	}
+
+	// splits the streams into fragment ranges and decides where each fragment's chunk goes, which is all the stream directory needs.
+	// returns the number of chunks. tiny streams that are stored outside of chunks get their data placed right after the chunk metadata.
+	uint32_t PlanStreamFragments(const PDBInputFile& inputFile,
+		const std::span<const PDBStreamInfo>& streamInfos,
+		const uint32_t blockSize,
+		const ProgramCommandLineArgs& args,
+		std::vector<MsfzStream>& outStreamDescs,
+		std::vector<FragmentRangeTask>& outTasks)
+	{
+		LogScoped("Splitting streams into fragments");
+
+		// fragments of the same stream can be compressed independently of each other, so the work is split by fragment ranges rather than streams
+		outStreamDescs.resize(streamInfos.size());
+		SplitStreamsIntoFragmentRanges(inputFile, streamInfos, blockSize, outStreamDescs, outTasks);
+		if (args.m_MaxRawStreamSize.value_or(0u) != 0)
+		{
+			KeepTinyStreamsOutOfChunks(streamInfos, args.m_MaxRawStreamSize.value(), outStreamDescs, outTasks);
+		}
+		if (args.m_PackedChunkSize.value_or(0u) != 0)
 		{
-			const uint32_t fixedFragmentSize = args.m_FixedFragmentSize.value();
-			const uint32_t maxFrps = args.m_MaxFragmentsPerStream.value();
-			return std::min(streamSize, std::max(fixedFragmentSize, StrictCastTo<uint32_t>(AlignTo(streamSize, maxFrps)) / maxFrps));
+			PackSmallStreamsIntoSharedChunks(streamInfos, outStreamDescs, args.m_PackedChunkSize.value(), outTasks);
 		}
-		else
+		if (args.m_ChunkLayout.value_or(ChunkLayout::StreamOrder) == ChunkLayout::LoadOrder)
 		{
-			return streamSize;
+			OrderFragmentRangesForLoading(streamInfos, outTasks);
 		}
+		const uint32_t numChunks = AssignChunkIndices(outTasks, outStreamDescs);
+		AssignRawFragmentOffsets(sizeof(MsfzHeader) + static_cast<uint64_t>(numChunks) * sizeof(MsfzChunk), outStreamDescs);
+		return numChunks;
 	}
 
-	void CalculateOutputRegionSizes(const std::span<const PDBStreamInfo>& streamInfos, 
-		const ProgramCommandLineArgs& args,
-		uint32_t& outDirectoryNumBytes,
-		uint32_t& outChunkDescNumBytes,
-		uint32_t& outChunkDataMaxNumBytes)
+	// feeds one piece of a fragment to zstd's streaming API, growing the chunk that's being written as needed
+	void CompressFragmentPiece(const std::span<const uint8_t>& fragmentPart, const ZSTD_EndDirective endDirective, ZSTD_CCtx* compressionContext, ZSTD_outBuffer& outputBuffer, ChunkDataSlab& chunkDataSlab)
 	{
-		const CompressionStrategy compressionStrategy = args.m_CompressionStrategy.value();
-		uint32_t numDirectoryBytes = 0;
-		uint32_t numChunkDescBytes = 0;
-		uint32_t maxNumChunkDataBytes = 0;
-		for (const PDBStreamInfo& streamInfo : streamInfos)
+		ZSTD_inBuffer inputBuffer = { fragmentPart.data(), fragmentPart.size(), 0 };
+		size_t numBytesPending = 0;
+		do
 		{
-			const uint32_t streamSize = streamInfo.m_StreamSize; 
-			uint32_t fragmentSize = 0;
-			uint32_t numFragments = 0;
-			if (streamSize != 0)
-			{
-				fragmentSize = GetFragmentSizeForStream(streamSize, args);
-				numFragments = AlignTo(streamSize, fragmentSize) / fragmentSize;
-			}
-			numDirectoryBytes += sizeof(uint32_t) + sizeof(MsfzFragment) * numFragments;
-			numChunkDescBytes += sizeof(MsfzChunk) * numFragments;
-
-			if (compressionStrategy == CompressionStrategy::NoCompression)
+			if (outputBuffer.size - outputBuffer.pos < ZSTD_CStreamOutSize())
 			{
-				maxNumChunkDataBytes += streamSize;
+				outputBuffer.size = outputBuffer.pos + ZSTD_CStreamOutSize();
+				outputBuffer.dst = chunkDataSlab.GrowChunk(outputBuffer.pos, outputBuffer.size);
 			}
-			else
+			numBytesPending = ZSTD_compressStream2(compressionContext, &outputBuffer, &inputBuffer, endDirective);
+			if (ZSTD_isError(numBytesPending))
 			{
-				maxNumChunkDataBytes += numFragments * StrictCastTo<uint32_t>(ZSTD_compressBound(fragmentSize));
+				ThrowError("Error when compressing data: %s", ZSTD_getErrorName(numBytesPending));
 			}
-		}
+		} while (endDirective == ZSTD_e_end ? numBytesPending != 0 : inputBuffer.pos < inputBuffer.size);
+	}
+
+	// compresses the next fragmentSize bytes from the block reader through the zstd streaming API, feeding it one run of consecutive blocks at a time,
+	// so that fragments scattered across the input never have to be coalesced
+	size_t CompressFragmentFromBlockReader(StreamBlockReader& blockReader, const uint32_t fragmentSize, ZSTD_CCtx* compressionContext, ChunkDataSlab& chunkDataSlab)
+	{
+		ZSTD_CCtx_setPledgedSrcSize(compressionContext, fragmentSize);
+
+		ZSTD_outBuffer outputBuffer = { chunkDataSlab.BeginChunk(ZSTD_CStreamOutSize()), ZSTD_CStreamOutSize(), 0 };
+		uint32_t numBytesLeft = fragmentSize;
+		do
+		{
+			const std::span<const uint8_t> fragmentPart = blockReader.ReadNext(numBytesLeft);
+			numBytesLeft -= StrictCastTo<uint32_t>(fragmentPart.size());
+			CompressFragmentPiece(fragmentPart, numBytesLeft == 0 ? ZSTD_e_end : ZSTD_e_continue, compressionContext, outputBuffer, chunkDataSlab);
+		} while (numBytesLeft > 0);
 
-		outDirectoryNumBytes = numDirectoryBytes;
-		outChunkDescNumBytes = numChunkDescBytes;
-		outChunkDataMaxNumBytes = maxNumChunkDataBytes;
+		return outputBuffer.pos;
 	}
 
-	void CoalesceDataFromStream(ImmutableStream& pdbFileStream, const PDBStreamInfo& streamInfo, const uint32_t blockSize, ReadOnlyVector<uint8_t>& outStreamData)
+	// compressed chunks have to be smaller than rawChunkThreshold percent of their data to be kept, all others are stored raw,
+	// so that reading them takes neither a decompression nor a copy
+	bool IsWorthCompressing(const size_t chunkSize, const uint32_t decompressedSize, const uint32_t rawChunkThreshold)
 	{
-		const std::vector<uint32_t>& streamBlockIndices = streamInfo.m_StreamBlockIndices;
-		const uint32_t streamSize = streamInfo.m_StreamSize;
-		const bool areStreamBlocksContiguous = std::is_sorted(streamBlockIndices.begin(), streamBlockIndices.end()) && streamBlockIndices.back() - streamBlockIndices.front() <= streamBlockIndices.size();
-		if (areStreamBlocksContiguous)
+		return static_cast<uint64_t>(chunkSize) * 100u < static_cast<uint64_t>(decompressedSize) * rawChunkThreshold;
+	}
+
+	// Fragments of already compressed or random data skip zstd altogether when a few samples spread over them look like noise: close to 8 bits
+	// of entropy per byte, and hardly any 4 byte sequence that repeats within the samples. Neither test sees matches with data in between the
+	// samples, so both cutoffs are strict, and whatever gets through is still compressed and checked with IsWorthCompressing().
+	class IncompressibleDataDetector
+	{
+	public:
+		static constexpr uint32_t k_NumSamples = 4u;
+		static constexpr uint32_t k_SampleSize = 4u << 10;
+		static constexpr uint32_t k_MinDataSize = k_NumSamples * k_SampleSize;
+
+		// samples are always read from the input file the same way, no matter how the rest of the fragment gets read
+		static bool IsFragmentLikelyIncompressible(const PDBInputFile& inputFile, const PDBStreamInfo& streamInfo, const uint32_t blockSize, const uint32_t fragmentOffset, const uint32_t fragmentSize)
 		{
-			const uint32_t streamOffset = blockSize * streamBlockIndices.front();
-			if (!pdbFileStream.CanRead(streamOffset, streamSize))
+			if (fragmentSize < k_MinDataSize)
 			{
-				ThrowError("Unable to read stream data from the input file. Offset: %u, Size: %u", streamOffset, streamSize);
+				return false;
 			}
-			outStreamData.AssignNonOwned({ pdbFileStream.PeekAtOffset<uint8_t>(streamOffset), streamSize });
-		}
-		else
-		{
-			MutableStreamDynamic coalescedDataStream;
-			coalescedDataStream.Reserve(streamSize);
-			uint32_t streamSizeLeftover = streamSize;
-			for (const uint32_t blockIndex : streamBlockIndices)
+
+			uint8_t samples[k_MinDataSize];
+			for (uint32_t sampleIndex = 0; sampleIndex < k_NumSamples; ++sampleIndex)
 			{
-				const uint32_t blockOffset = blockSize * blockIndex;
-				const uint32_t sizeToRead = std::min(streamSizeLeftover, blockSize);
-				if (!pdbFileStream.CanRead(blockOffset, sizeToRead))
+				if (!ReadStreamBytes(inputFile, streamInfo, blockSize, fragmentOffset + GetSampleOffset(fragmentSize, sampleIndex), k_SampleSize, samples + sampleIndex * k_SampleSize))
 				{
-					ThrowError("Unable to read stream data from the input file. Offset: %u, Size: %u", blockOffset, sizeToRead);
+					ThrowError("Unable to read stream data from the input file. Stream offset: %u, Size: %u", fragmentOffset, fragmentSize);
 				}
-				coalescedDataStream.WriteBytes(pdbFileStream.PeekAtOffset<uint8_t>(blockOffset), sizeToRead);
-				streamSizeLeftover -= sizeToRead;
 			}
-			std::vector<uint8_t> coalescedDataStreamData;
-			coalescedDataStream.MoveTo(coalescedDataStreamData);
-			outStreamData.AssignOwned(coalescedDataStreamData);
+			return AreSamplesIncompressible(samples);
 		}
-	}
-
-	void ParseStreamDirectory(ImmutableStream& pdbFileStream, const PDBSuperBlock* pdbSuperblock, std::vector<PDBStreamInfo>& outStreams)
-	{
-		const uint32_t blockSize = pdbSuperblock->m_BlockSize;
-		const uint32_t directorySizeInBytes = pdbSuperblock->m_DirectorySize;
 
-		// read directory indices stream info
-		PDBStreamInfo directoryIndicesStreamInfo = {};
-		const uint32_t directoryBlockIndicesSize = AlignTo(directorySizeInBytes, blockSize) / blockSize;
-		const uint32_t directoryBlockIndicesByteSize = directoryBlockIndicesSize * sizeof(uint32_t);
-		const uint32_t directoryBlockIndicesStreamSize = AlignTo(directoryBlockIndicesByteSize, blockSize) / blockSize;
-		directoryIndicesStreamInfo.m_StreamSize = directoryBlockIndicesByteSize;
-		directoryIndicesStreamInfo.m_StreamBlockIndices.resize(directoryBlockIndicesStreamSize);
-		ImmutableStream directoryBlockIndicesStream = pdbFileStream.GetStreamAtOffset(sizeof(PDBSuperBlock), directoryBlockIndicesStreamSize * sizeof(uint32_t));
-		directoryBlockIndicesStream.ReadData(directoryIndicesStreamInfo.m_StreamBlockIndices.data());
-
-		// get directory stream indices data
-		ReadOnlyVector<uint8_t> directoryIndicesData;
-		CoalesceDataFromStream(pdbFileStream, directoryIndicesStreamInfo, blockSize, directoryIndicesData);
-		ImmutableStream directoryIndicesStream(directoryIndicesData.GetData(), directoryIndicesData.GetSize());
+		static bool IsDataLikelyIncompressible(const std::span<const uint8_t>& data)
+		{
+			if (data.size() < k_MinDataSize)
+			{
+				return false;
+			}
 
-		// read directory stream info
-		PDBStreamInfo directoryStreamInfo = {};
-		directoryStreamInfo.m_StreamSize = directorySizeInBytes;
-		directoryStreamInfo.m_StreamBlockIndices.resize(directoryBlockIndicesSize);
-		memcpy(directoryStreamInfo.m_StreamBlockIndices.data(), directoryIndicesData.GetData(), directoryBlockIndicesSize * sizeof(uint32_t));
+			uint8_t samples[k_MinDataSize];
+			for (uint32_t sampleIndex = 0; sampleIndex < k_NumSamples; ++sampleIndex)
+			{
+				memcpy(samples + sampleIndex * k_SampleSize, data.data() + GetSampleOffset(StrictCastTo<uint32_t>(data.size()), sampleIndex), k_SampleSize);
+			}
+			return AreSamplesIncompressible(samples);
+		}
 
-		// finally, get the real directory stream data. mental.
-		ReadOnlyVector<uint8_t> directoryData;
-		CoalesceDataFromStream(pdbFileStream, directoryStreamInfo, blockSize, directoryData);
-		ImmutableStream directoryStream(directoryData.GetData(), directoryData.GetSize());
+	private:
+		static constexpr double k_MinBitsPerByte = 7.95;	// uniformly random samples of this size come out at ~7.99
+		static constexpr uint32_t k_MaxRepeatsPerMille = 5;
 
-		// setup number of streams
-		const uint32_t* numStreamsPtr = directoryStream.PeekAtOffset<uint32_t>(0);
-		if (numStreamsPtr == nullptr)
+		static uint32_t GetSampleOffset(const uint32_t dataSize, const uint32_t sampleIndex)
 		{
-			ThrowError("Unable to read the count of MSF streams from the input file.");
+			return StrictCastTo<uint32_t>(static_cast<uint64_t>(dataSize - k_SampleSize) * sampleIndex / (k_NumSamples - 1));
 		}
-		const uint32_t numStreams = *numStreamsPtr;
-		outStreams.resize(numStreams);
 
-		// parse directory data
-		ImmutableStream streamSizesStream = directoryStream.GetStreamAtOffset(sizeof(uint32_t), sizeof(uint32_t) * numStreams);
-		ImmutableStream blockIndicesStream = directoryStream.GetStreamAtOffset(sizeof(uint32_t) + sizeof(uint32_t) * numStreams);
-		for (uint32_t streamIndex = 0; streamIndex < numStreams; ++streamIndex)
+		static bool AreSamplesIncompressible(const uint8_t (&samples)[k_MinDataSize])
 		{
-			const uint32_t* streamSizePtr = streamSizesStream.Read<uint32_t>();
-			PDBStreamInfo& streamInfo = outStreams[streamIndex];
-			if (streamSizePtr == nullptr)
+			// 4 byte sequences are looked up by hash, among the last positions each hash was seen at
+			std::vector<uint16_t> lastPositions(1u << 12, UINT16_MAX);
+			uint32_t byteCounts[256] = {};
+			uint32_t numRepeats = 0;
+			for (uint32_t position = 0; position < k_MinDataSize; ++position)
 			{
-				ThrowError("Unable to read size of the stream from the input file. Stream index: %u", streamIndex);
-			}
-			streamInfo.m_StreamSize = *streamSizePtr;
+				++byteCounts[samples[position]];
+				if (position + sizeof(uint32_t) > k_MinDataSize)
+				{
+					continue;
+				}
 
-			if (streamInfo.m_StreamSize == UINT32_MAX || streamInfo.m_StreamSize == 0)
+				uint32_t sequence = 0;
+				memcpy(&sequence, samples + position, sizeof(sequence));
+				uint16_t& lastPosition = lastPositions[(sequence * 2654435761u) >> 20];
+				if (lastPosition != UINT16_MAX && memcmp(samples + lastPosition, samples + position, sizeof(sequence)) == 0)
+				{
+					++numRepeats;
+				}
+				lastPosition = static_cast<uint16_t>(position);
+			}
+			if (numRepeats * 1000u > k_MaxRepeatsPerMille * k_MinDataSize)
 			{
-				streamInfo.m_StreamSize = 0;
-				continue;
+				return false;
 			}
 
-			std::vector<uint32_t>& streamBlockIndices = streamInfo.m_StreamBlockIndices;
-			for (uint32_t blockIterator = 0; blockIterator < *streamSizePtr; blockIterator += blockSize)
+			double bitsPerByte = 0.0;
+			for (const uint32_t byteCount : byteCounts)
 			{
-				const uint32_t* blockIndexPtr = blockIndicesStream.Read<uint32_t>();
-				if (blockIndexPtr == nullptr)
+				if (byteCount != 0)
 				{
-					ThrowError("Unable to read block indices from the input file.");
+					const double byteProbability = byteCount * 1.0 / k_MinDataSize;
+					bitsPerByte -= byteProbability * std::log2(byteProbability);
 				}
-				streamBlockIndices.push_back(*blockIndexPtr);
 			}
+			return bitsPerByte >= k_MinBitsPerByte;
+		}
+	};
+
+	// the smallest window zstd picks for inputs this large, at any compression level
+	constexpr uint32_t k_MinZstdWindowSize = 1u << 19;
+
+	// compresses a fragment that's in memory into a chunk in the slab, returns the chunk size
+	size_t CompressFragment(const uint8_t* fragmentData, const uint32_t fragmentSize, ZSTD_CCtx* compressionContext, ChunkDataSlab& chunkDataSlab)
+	{
+		// Once a fragment doesn't fit in zstd's window, single-threaded zstd compresses it differently in one go than when it's fed piece by piece,
+		// which is how fragments that are read block by block get compressed. Fragments that may not fit in the window at any level are fed as
+		// a stream too, so the output doesn't depend on whether the input was mapped or streamed. Handing zstd the whole fragment with ZSTD_e_end
+		// would let it take its one-shot path again, so all but the last byte go in with ZSTD_e_continue. The streaming path buffers its input and
+		// compresses it block by block, which makes its output the same wherever the pieces are split.
+		if (fragmentSize > k_MinZstdWindowSize)
+		{
+			ZSTD_CCtx_setPledgedSrcSize(compressionContext, fragmentSize);
+			ZSTD_outBuffer outputBuffer = { chunkDataSlab.BeginChunk(ZSTD_CStreamOutSize()), ZSTD_CStreamOutSize(), 0 };
+			CompressFragmentPiece({ fragmentData, fragmentSize - 1u }, ZSTD_e_continue, compressionContext, outputBuffer, chunkDataSlab);
+			CompressFragmentPiece({ fragmentData + fragmentSize - 1u, 1u }, ZSTD_e_end, compressionContext, outputBuffer, chunkDataSlab);
+			return outputBuffer.pos;
+		}
+
+		const size_t maxCompressedStreamDataLength = ZSTD_compressBound(fragmentSize);
+		const size_t chunkSize = ZSTD_compress2(
+			compressionContext,
+			chunkDataSlab.BeginChunk(maxCompressedStreamDataLength),
+			maxCompressedStreamDataLength,
+			fragmentData,
+			fragmentSize
+		);
+
+		if (ZSTD_isError(chunkSize))
+		{
+			ThrowError("Error when compressing data: %llx", chunkSize);
 		}
+		return chunkSize;
 	}
 
-	void WriteSingleStreamData(ImmutableStream& pdbFileStream,
+	// A fragment range on its way through the compression pipeline, see CompressAndWriteStreamData()
+	struct FragmentRangeInFlight
+	{
+		// ranges of streamed input are read into memory by the fetch stage unless they're too large,
+		// in which case they're left for the compress stage to read piece by piece, like ranges of mapped input are
+		static constexpr uint64_t k_MaxNumFetchedBytes = 16u << 20;
+
+		std::vector<uint8_t> m_StreamData;	// empty if the range isn't fetched into memory
+		std::unique_ptr<ChunkDataSlab> m_ChunkDataSlab;
+		uint32_t m_WorkerIndex = 0;	// worker that compressed the range, its slab goes back to that worker's free slabs
+	};
+
+	void FetchFragmentRange(const PDBInputFile& inputFile,
 		const PDBStreamInfo& streamInfo,
+		const FragmentRangeTask& task,
 		const uint32_t blockSize,
-		const uint32_t chunkDataOffset,
-		const ProgramCommandLineArgs& args,
-		SimpleMutableStreamFixedThreadSafe& outChunkDataStream,
-		MsfzStream& outStreamDesc,
-		SimpleMutableStreamFixedThreadSafe& outChunkMetadataStream)
+		const uint64_t maxNumFetchedBytes,
+		FragmentRangeInFlight& outRange)
+	{
+		StreamBlockReader blockReader(inputFile, streamInfo, blockSize, 0, task.m_StreamOffset);
+		if (!inputFile.IsStreamed())
+		{
+			blockReader.PrefetchNext(task.m_NumBytes);
+		}
+		else if (task.m_NumBytes <= maxNumFetchedBytes)
+		{
+			outRange.m_StreamData.resize(task.m_NumBytes);
+			blockReader.ReadInto(outRange.m_StreamData.data(), task.m_NumBytes);
+		}
+	}
+
+	// packed streams are small, so they're always read into memory, one after another like they follow each other in their chunk
+	void FetchPackedStreams(const PDBInputFile& inputFile,
+		const std::span<const PDBStreamInfo>& streamInfos,
+		const FragmentRangeTask& task,
+		const uint32_t blockSize,
+		FragmentRangeInFlight& outRange)
+	{
+		outRange.m_StreamData.resize(task.m_NumBytes);
+		uint8_t* streamData = outRange.m_StreamData.data();
+		for (const uint32_t streamIndex : task.m_PackedStreamIndices)
+		{
+			const PDBStreamInfo& streamInfo = streamInfos[streamIndex];
+			StreamBlockReader blockReader(inputFile, streamInfo, blockSize, 0);
+			blockReader.ReadInto(streamData, streamInfo.m_StreamSize);
+			streamData += streamInfo.m_StreamSize;
+		}
+	}
+
+	// all streams in a packed chunk are compressed the same way, see PackSmallStreamsIntoSharedChunks()
+	void WritePackedChunk(const StreamCompressionSettings& compressionSettings,
+		const std::span<const uint8_t>& packedStreamData,
+		const CompressionContextPool& compressionContextPool,
+		ChunkDataSlab& outChunkDataSlab)
+	{
+		const uint32_t chunkDataSize = StrictCastTo<uint32_t>(packedStreamData.size());
+		const uint32_t rawChunkThreshold = compressionSettings.m_RawChunkThreshold;
+		bool isCompressed = compressionSettings.m_Strategy != CompressionStrategy::NoCompression && !IncompressibleDataDetector::IsDataLikelyIncompressible(packedStreamData);
+		size_t chunkSize = chunkDataSize;
+		if (isCompressed)
+		{
+			chunkSize = CompressFragment(packedStreamData.data(), chunkDataSize, compressionContextPool.GetForCurrentWorker(chunkDataSize, compressionSettings.m_Level), outChunkDataSlab);
+			isCompressed = IsWorthCompressing(chunkSize, chunkDataSize, rawChunkThreshold);
+		}
+		if (!isCompressed)
+		{
+			chunkSize = chunkDataSize;
+			memcpy(outChunkDataSlab.BeginChunk(chunkDataSize), packedStreamData.data(), chunkDataSize);
+		}
+		outChunkDataSlab.EndChunk(chunkSize, chunkDataSize, isCompressed);
+	}
+
+	void WriteStreamFragments(const PDBInputFile& inputFile,
+		const PDBStreamInfo& streamInfo,
+		const FragmentRangeTask& task,
+		const std::span<const MsfzFragment>& rangeFragments,
+		const std::span<const uint8_t>& fetchedRangeData,
+		const uint32_t blockSize,
+		const CompressionContextPool& compressionContextPool,
+		ChunkDataSlab& outChunkDataSlab)
 	{
-		const CompressionStrategy compressionStrategy = args.m_CompressionStrategy.value();
-		const uint32_t compressionLevel = args.m_CompressionLevel.value();
-		const uint32_t streamDataSize = streamInfo.m_StreamSize;
+		const CompressionStrategy compressionStrategy = streamInfo.m_CompressionSettings.m_Strategy;
+		const uint32_t compressionLevel = streamInfo.m_CompressionSettings.m_Level;
+		const uint32_t rawChunkThreshold = streamInfo.m_CompressionSettings.m_RawChunkThreshold;
+		const uint32_t rangeBeginOffset = task.m_StreamOffset;
 
-		if (streamDataSize > 0)
 		{
+			// ranges that weren't fetched into memory are used in place if their stream sits in one piece in the mapped input, all others are
+			// read block run by block run instead of coalescing the whole stream upfront
 			ReadOnlyVector<uint8_t> streamDataCoalesced;
-			CoalesceDataFromStream(pdbFileStream, streamInfo, blockSize, streamDataCoalesced);
+			std::optional<StreamBlockReader> streamBlockReader;
+			if (!fetchedRangeData.empty())
+			{
+				streamDataCoalesced.AssignNonOwned(fetchedRangeData);
+			}
+			else if (inputFile.IsStreamed() || !AreStreamBlocksContiguous(streamInfo))
+			{
+				streamBlockReader.emplace(inputFile, streamInfo, blockSize, inputFile.GetNumBlocksPerReader(blockSize), rangeBeginOffset);
+			}
+			else
+			{
+				CoalesceDataFromStream(inputFile, streamInfo, blockSize, streamDataCoalesced);
+			}
 			const uint8_t* streamData = streamDataCoalesced.GetData();
-			const uint32_t streamDataLength = StrictCastTo<uint32_t>(streamDataCoalesced.GetSize());
-			const uint32_t maxFragmentSize = GetFragmentSizeForStream(streamDataLength, args);
-			for (uint32_t dataOffset = 0; dataOffset < streamDataLength; dataOffset += maxFragmentSize)
-			{
-				uint64_t chunkDescOffset = 0;
-				MutableStreamFixed chunkDescStream = outChunkMetadataStream.GetRegionSubstreamForWriting(sizeof(MsfzChunk), chunkDescOffset);
-				const uint32_t chunkIndex = StrictCastTo<uint32_t>(chunkDescOffset / sizeof(MsfzChunk));
-
-				const uint32_t fragmentSize = std::min(maxFragmentSize, streamDataLength - dataOffset);
-				MsfzFragment& fragment = outStreamDesc.m_Fragments.emplace_back();
-				fragment.SetChunkIndex(chunkIndex);
-				fragment.m_DataSize = fragmentSize;
-				fragment.m_DataOffset = 0;
-
-				ReadOnlyVector<uint8_t> streamDataToWrite;
-				if (compressionStrategy != CompressionStrategy::NoCompression)
-				{
-					std::vector<uint8_t> compressedStreamData;
-					compressedStreamData.resize(ZSTD_compressBound(fragmentSize));
-					const size_t compressedStreamDataLength = ZSTD_compress(
-						compressedStreamData.data(),
-						compressedStreamData.size(),
-						(uint8_t*)streamData + dataOffset,
-						fragmentSize,
-						compressionLevel
-					);
-
-					if (ZSTD_isError(compressedStreamDataLength))
+			const uint32_t streamDataBeginOffset = fetchedRangeData.empty() ? 0u : rangeBeginOffset;
+			uint32_t dataOffset = rangeBeginOffset;
+			for (const MsfzFragment& fragment : rangeFragments)
+			{
+				const uint32_t fragmentSize = fragment.m_DataSize;
+
+				// fragments that fall entirely within a run of blocks are used in place, just like contiguous streams
+				const uint8_t* fragmentData = nullptr;
+				if (!streamBlockReader)
+				{
+					fragmentData = streamData + (dataOffset - streamDataBeginOffset);
+				}
+				else if (const std::optional<std::span<const uint8_t>> fragmentInPlace = streamBlockReader->TryReadInPlace(fragmentSize))
+				{
+					fragmentData = fragmentInPlace->data();
+				}
+
+				bool isCompressed = compressionStrategy != CompressionStrategy::NoCompression
+					&& !IncompressibleDataDetector::IsFragmentLikelyIncompressible(inputFile, streamInfo, blockSize, dataOffset, fragmentSize);
+				bool isFragmentReadFromBlockReader = false;
+				size_t chunkSize = fragmentSize;
+				if (isCompressed)
+				{
+					if (fragmentData == nullptr)
+					{
+						chunkSize = CompressFragmentFromBlockReader(*streamBlockReader, fragmentSize, compressionContextPool.GetForCurrentWorker(fragmentSize, compressionLevel), outChunkDataSlab);
+						isFragmentReadFromBlockReader = true;
+					}
+					else
 					{
-						ThrowError("Error when compressing data: %llx", compressedStreamDataLength);
+						chunkSize = CompressFragment(fragmentData, fragmentSize, compressionContextPool.GetForCurrentWorker(fragmentSize, compressionLevel), outChunkDataSlab);
 					}
+					isCompressed = IsWorthCompressing(chunkSize, fragmentSize, rawChunkThreshold);
+				}
 
-					compressedStreamData.resize(compressedStreamDataLength);
-					streamDataToWrite.AssignOwned(compressedStreamData);
+				if (!isCompressed)
+				{
+					// raw data replaces whatever got compressed into the slab
+					chunkSize = fragmentSize;
+					uint8_t* chunkData = outChunkDataSlab.BeginChunk(fragmentSize);
+					if (fragmentData != nullptr)
+					{
+						memcpy(chunkData, fragmentData, fragmentSize);
+					}
+					else if (!isFragmentReadFromBlockReader)
+					{
+						// raw data goes straight from the input file into the slab
+						streamBlockReader->ReadInto(chunkData, fragmentSize);
+					}
+					else if (!ReadStreamBytes(inputFile, streamInfo, blockSize, dataOffset, fragmentSize, chunkData))
+					{
+						// the block reader is already past the fragment, so it's read once more
+						ThrowError("Unable to read stream data from the input file. Stream offset: %u, Size: %u", dataOffset, fragmentSize);
+					}
 				}
-				else
+				outChunkDataSlab.EndChunk(chunkSize, fragmentSize, isCompressed);
+				dataOffset += fragmentSize;
+			}
+		}
+	}
+
+	// writes the data of the fragments that aren't in any chunk, at the offsets AssignRawFragmentOffsets() gave them
+	void WriteRawStreamData(const PDBInputFile& inputFile,
+		const std::span<const PDBStreamInfo>& streamInfos,
+		const std::span<const MsfzStream>& streamDescs,
+		const uint32_t blockSize,
+		BufferedFileWriter& outputFileWriter)
+	{
+		std::vector<uint8_t> streamData;
+		for (uint32_t streamIndex = 0; streamIndex < streamDescs.size(); ++streamIndex)
+		{
+			uint32_t streamOffset = 0;
+			for (const MsfzFragment& fragment : streamDescs[streamIndex].m_Fragments)
+			{
+				if (!fragment.IsLocatedInChunk())
 				{
-					streamDataToWrite.AssignNonOwned({ streamData, fragmentSize });
+					streamData.resize(fragment.m_DataSize);
+					if (outputFileWriter.GetOffset() != fragment.m_DataOffset
+						|| !ReadStreamBytes(inputFile, streamInfos[streamIndex], blockSize, streamOffset, fragment.m_DataSize, streamData.data())
+						|| !outputFileWriter.Append(streamData.data(), fragment.m_DataSize))
+					{
+						ThrowError("Unable to write raw stream data to the output file. Stream index: %u", streamIndex);
+					}
 				}
+				streamOffset += fragment.m_DataSize;
+			}
+		}
+	}
+
+	// serializes the stream directory and compresses it if needed, filling in the related header values
+	void BuildStreamDirectory(const std::span<const MsfzStream>& streamDescs, const ProgramCommandLineArgs& args, MsfzHeader& header, MutableStreamDynamic& outDirectoryDataStream)
+	{
+		LogScoped("Compressing stream directory data");
+
+		MutableStreamDynamic streamDirectoryDataStream;
+		for (const MsfzStream& streamDesc : streamDescs)
+		{
+			for (const MsfzFragment& fragmentDesc : streamDesc.m_Fragments)
+			{
+				streamDirectoryDataStream.Write(fragmentDesc);
+			}
+			streamDirectoryDataStream.Write<uint32_t>(0u);	// separator
+		}
 
-				uint64_t chunkDataOffsetForWriting = 0;
-				MutableStreamFixed chunkDataSubstreamForWriting = outChunkDataStream.GetRegionSubstreamForWriting(streamDataToWrite.GetSize(), chunkDataOffsetForWriting);
-				chunkDataSubstreamForWriting.WriteBytes(streamDataToWrite.GetData(), streamDataToWrite.GetSize());
+		header.m_NumMSFStreams = StrictCastTo<uint32_t>(streamDescs.size());
 
-				MsfzChunk chunkDesc = {};
-				chunkDesc.m_DecompressedSize = fragmentSize;
-				chunkDesc.m_IsCompressed = compressionStrategy != CompressionStrategy::NoCompression;
-				chunkDesc.m_OriginToChunk = 0;
-				chunkDesc.m_OffsetToChunkData = StrictCastTo<uint32_t>(chunkDataOffset + chunkDataOffsetForWriting);
-				chunkDesc.m_CompressedSize = StrictCastTo<uint32_t>(streamDataToWrite.GetSize());
-				chunkDescStream.Write(chunkDesc);
+		const size_t streamDirectoryDataLength = StrictCastTo<size_t>(streamDirectoryDataStream.GetSize());
+		header.m_StreamDirectoryDataLengthDecompressed = StrictCastTo<uint32_t>(streamDirectoryDataLength);
+		// the directory is stored raw if compressing it doesn't make it smaller
+		std::vector<uint8_t> compressedStreamDirectoryData;
+		size_t compressedStreamDirectoryDataLength = streamDirectoryDataLength;
+		if (args.m_CompressionStrategy.value() != CompressionStrategy::NoCompression)
+		{
+			compressedStreamDirectoryData.resize(ZSTD_compressBound(streamDirectoryDataLength));
+			compressedStreamDirectoryDataLength = ZSTD_compress(
+				compressedStreamDirectoryData.data(),
+				compressedStreamDirectoryData.size(),
+				streamDirectoryDataStream.GetData(),
+				streamDirectoryDataLength,
+				3);
+			if (ZSTD_isError(compressedStreamDirectoryDataLength))
+			{
+				ThrowError("Error when compressing data: 0x%llx", compressedStreamDirectoryDataLength);
 			}
 		}
+		if (IsWorthCompressing(compressedStreamDirectoryDataLength, header.m_StreamDirectoryDataLengthDecompressed, 100u))
+		{
+			compressedStreamDirectoryData.resize(compressedStreamDirectoryDataLength);
+			outDirectoryDataStream.WriteSpan<uint8_t>(compressedStreamDirectoryData);
+			header.m_IsStreamDirectoryDataCompressed = true;
+		}
+		else
+		{
+			outDirectoryDataStream = std::move(streamDirectoryDataStream);
+			header.m_IsStreamDirectoryDataCompressed = false;
+		}
 	}
 
-	void CompressAndWriteStreamData(ImmutableStream& pdbFile,
+	// lower bound of the in-flight budget when the input is mapped, where it only bounds the chunk data waiting to be committed
+	constexpr uint64_t k_MinNumBytesInFlight = 64u << 20;
+
+	void CompressAndWriteStreamData(const PDBInputFile& inputFile,
 		const std::span<const PDBStreamInfo>& streamInfos,
-		const ProgramCommandLineArgs& args,
+		const std::span<const MsfzStream>& streamDescs,
+		const std::span<const FragmentRangeTask>& fragmentRangeTasks,
 		const uint32_t blockSize,
-		const uint32_t chunkDataOffset,
-		MsfzHeader& header,
-		MutableStreamDynamic& outDirectoryDataStream,
-		SimpleMutableStreamFixedThreadSafe& outChunkMetadataStream,
-		SimpleMutableStreamFixedThreadSafe& outChunkDataStream)
+		const MutableStreamFixed& outChunkMetadataStream,
+		ChunkDataWriter& outChunkDataWriter)
 	{
-		const CompressionStrategy compressionStrategy = args.m_CompressionStrategy.value();
+		LogProgressTracker progressLog("Converting streams", StrictCastTo<uint32_t>(fragmentRangeTasks.size()));
 
-		const uint32_t numStreams = StrictCastTo<uint32_t>(streamInfos.size());;
+		// for progress tracking
+		const size_t allStreamsSize = std::accumulate(streamInfos.begin(), streamInfos.end(), static_cast<size_t>(0u),
+			[](size_t sumSoFar, const PDBStreamInfo& info) -> size_t { return sumSoFar + info.m_StreamSize; });
 
-		MutableStreamDynamic streamDirectoryDataStream;
-		std::vector<MsfzStream> streamDescriptors(numStreams);
+		// the ranges go through three stages, connected by bounded queues:
+		// 1) fetch: a single thread goes through the ranges in order. Ranges of streamed input are read into memory, for mapped input the OS
+		// is asked to start paging the range in. Either way, disk reads overlap with compression of the ranges before them.
+		// 2) compress: the worker threads compress the fragments of a range into the range's own slab of chunk data.
+		// 3) commit: a single thread appends the slabs to the output file in range order, as soon as all ranges before them are done.
+		// every range holds its size from the in-flight budget from being fetched until it's committed, so memory use stays bounded
+		// no matter how far ahead of the slowest range the fetch stage gets. The memory the compress stage allocates on top of that, chunk data
+		// slabs and zstd contexts, is charged to the same budget as it grows, and slabs that are kept for reuse stay charged until they're freed.
+		// With streamed input the budget is what the stream readers leave of the memory limit, so the limit covers the whole pipeline.
+		const uint32_t numRanges = StrictCastTo<uint32_t>(fragmentRangeTasks.size());
+		const uint32_t numThreads = ThreadPool::Get().GetNumThreads();
+		const uint64_t maxNumBytesInFlight = inputFile.IsStreamed() ? inputFile.GetInFlightMemoryLimit() : std::max<uint64_t>(k_MinNumBytesInFlight, numThreads * 4 * FragmentRangeTask::k_TargetNumBytes);
+		InFlightByteBudget inFlightByteBudget(maxNumBytesInFlight);
+		std::vector<FragmentRangeInFlight> rangesInFlight(numRanges);
+		BoundedQueue<uint32_t> fetchedRanges(numThreads * 2);
+		BoundedQueue<uint32_t> compressedRanges(numThreads * 2);
+		// slabs are reused by the worker that first filled them, so that their pages stay on that worker's NUMA node when workers are pinned
+		std::vector<std::unique_ptr<BoundedQueue<std::unique_ptr<ChunkDataSlab>>>> freeChunkDataSlabs(numThreads);
+		for (std::unique_ptr<BoundedQueue<std::unique_ptr<ChunkDataSlab>>>& workerFreeChunkDataSlabs : freeChunkDataSlabs)
 		{
-			LogProgressTracker m_ProgressLog("Converting streams", StrictCastTo<uint32_t>(streamInfos.size()));
+			workerFreeChunkDataSlabs = std::make_unique<BoundedQueue<std::unique_ptr<ChunkDataSlab>>>(2);
+		}
 
-			// for progress tracking
-			const size_t allStreamsSize = std::accumulate(streamInfos.begin(), streamInfos.end(), static_cast<size_t>(0u),
-				[](size_t sumSoFar, const PDBStreamInfo& info) -> size_t { return sumSoFar + info.m_StreamSize; });
+		// fetched ranges are read once, front to back, by whichever worker takes them, so they're left on the fetch thread's node. Pinning the
+		// fetch thread still keeps them all on one node rather than wherever the scheduler happened to run it.
+		std::thread fetchThread([&]()
+			{
+				if (ThreadConfig::GetPinWorkersToNumaNodes())
+				{
+					ThreadConfig::PinCurrentThreadToNumaNode(0, numThreads);
+				}
+				const uint64_t maxNumFetchedBytes = std::min(FragmentRangeInFlight::k_MaxNumFetchedBytes, maxNumBytesInFlight);
+				for (uint32_t rangeIndex = 0; rangeIndex < numRanges; ++rangeIndex)
+				{
+					const FragmentRangeTask& task = fragmentRangeTasks[rangeIndex];
+					inFlightByteBudget.Acquire(task.m_NumBytes);
+					if (task.IsPacked())
+					{
+						FetchPackedStreams(inputFile, streamInfos, task, blockSize, rangesInFlight[rangeIndex]);
+					}
+					else
+					{
+						FetchFragmentRange(inputFile, streamInfos[task.m_StreamIndex], task, blockSize, maxNumFetchedBytes, rangesInFlight[rangeIndex]);
+					}
+					fetchedRanges.Push(uint32_t(rangeIndex));
+				}
+				fetchedRanges.Close();
+			});
 
-			ParallelForRunner streamCompressionRunner(streamInfos);
-			streamCompressionRunner.SetScoreFunction([](const PDBStreamInfo& element, uint32_t /*elementIndex*/ ) { return element.m_StreamSize; });
-			streamCompressionRunner.Execute([&](const PDBStreamInfo& streamInfo, uint32_t streamIndex)
+		std::thread commitThread([&]()
+			{
+				std::vector<bool> isRangeCompressed(numRanges);
+				uint32_t numRangesCommitted = 0;
+				uint32_t rangeIndex = 0;
+				while (compressedRanges.Pop(rangeIndex))
 				{
-					MsfzStream& streamDesc = streamDescriptors[streamIndex];
-					WriteSingleStreamData(pdbFile, streamInfo, blockSize, chunkDataOffset, args, outChunkDataStream, streamDesc, outChunkMetadataStream);
+					isRangeCompressed[rangeIndex] = true;
+					for (; numRangesCommitted < numRanges && isRangeCompressed[numRangesCommitted]; ++numRangesCommitted)
+					{
+						const FragmentRangeTask& task = fragmentRangeTasks[numRangesCommitted];
+						FragmentRangeInFlight& range = rangesInFlight[numRangesCommitted];
+						range.m_ChunkDataSlab->Flush(outChunkDataWriter, outChunkMetadataStream, task.m_FirstChunkIndex);
+						const size_t slabCapacity = range.m_ChunkDataSlab->GetCapacity();
+						if (!freeChunkDataSlabs[range.m_WorkerIndex]->TryPush(std::move(range.m_ChunkDataSlab)))
+						{
+							range.m_ChunkDataSlab.reset();
+							inFlightByteBudget.Refund(slabCapacity);
+						}
+						inFlightByteBudget.Release(task.m_NumBytes);
 
-					m_ProgressLog.UpdateProgress(1, streamInfo.m_StreamSize * 1.0f / allStreamsSize);
-				});
+						progressLog.UpdateProgress(1, task.m_NumBytes * 1.0f / allStreamsSize);
+					}
+				}
+			});
 
-			// write stream desc to the directory stream
-			for (const MsfzStream& streamDesc : streamDescriptors)
+		// one compress loop per worker thread, each taking fetched ranges until there are none left
+		const std::vector<uint32_t> compressLoops(numThreads);
+		ParallelForRunner<const uint32_t> compressRunner(compressLoops);
+		const CompressionContextPool compressionContextPool(compressRunner.GetNumThreads());
+		std::vector<size_t> chargedContextMemoryUsages(compressRunner.GetNumThreads());
+		compressRunner.Execute([&](const uint32_t /*element*/, uint32_t /*loopIndex*/)
 			{
-				for (const MsfzFragment& fragmentDesc : streamDesc.m_Fragments)
+				size_t& chargedContextMemoryUsage = chargedContextMemoryUsages[WorkerThread::GetIndex()];
+				uint32_t rangeIndex = 0;
+				while (fetchedRanges.Pop(rangeIndex))
 				{
-					streamDirectoryDataStream.Write(fragmentDesc);
+					const FragmentRangeTask& task = fragmentRangeTasks[rangeIndex];
+					FragmentRangeInFlight& range = rangesInFlight[rangeIndex];
+					range.m_WorkerIndex = WorkerThread::GetIndex();
+					if (!freeChunkDataSlabs[range.m_WorkerIndex]->TryPop(range.m_ChunkDataSlab))
+					{
+						range.m_ChunkDataSlab = std::make_unique<ChunkDataSlab>();
+					}
+					const size_t slabCapacity = range.m_ChunkDataSlab->GetCapacity();	// a reused slab's capacity is already charged
+					if (task.IsPacked())
+					{
+						WritePackedChunk(streamInfos[task.m_StreamIndex].m_CompressionSettings, range.m_StreamData, compressionContextPool, *range.m_ChunkDataSlab);
+					}
+					else
+					{
+						const std::span<const MsfzFragment> rangeFragments = std::span<const MsfzFragment>(streamDescs[task.m_StreamIndex].m_Fragments).subspan(task.m_FirstFragmentIndex, task.m_NumFragments);
+						WriteStreamFragments(inputFile, streamInfos[task.m_StreamIndex], task, rangeFragments, range.m_StreamData, blockSize, compressionContextPool, *range.m_ChunkDataSlab);
+					}
+					std::vector<uint8_t>().swap(range.m_StreamData);
+
+					inFlightByteBudget.Charge(range.m_ChunkDataSlab->GetCapacity() - slabCapacity);
+					const size_t contextMemoryUsage = compressionContextPool.GetCurrentWorkerMemoryUsage();
+					if (contextMemoryUsage > chargedContextMemoryUsage)
+					{
+						inFlightByteBudget.Charge(contextMemoryUsage - chargedContextMemoryUsage);
+					}
+					else
+					{
+						inFlightByteBudget.Refund(chargedContextMemoryUsage - contextMemoryUsage);
+					}
+					chargedContextMemoryUsage = contextMemoryUsage;
+
+					compressedRanges.Push(uint32_t(rangeIndex));
 				}
-				streamDirectoryDataStream.Write<uint32_t>(0u);	// separator
+			});
+
+		compressedRanges.Close();
+		fetchThread.join();
+		commitThread.join();
+	}
+
+	// counts the records in the record regions of a stream, and the fragments that have to be decompressed to read each of them once
+	void CountRecordLookups(const PDBInputFile& inputFile,
+		const PDBStreamInfo& streamInfo,
+		const uint32_t blockSize,
+		const std::span<const MsfzFragment>& fragments,
+		uint64_t& outNumRecords,
+		uint64_t& outNumFragmentReads)
+	{
+		RecordWalker recordWalker(inputFile, streamInfo, blockSize);
+		size_t fragmentIndex = 0;
+		uint64_t fragmentEndOffset = fragments.empty() ? 0u : fragments.front().m_DataSize;
+		uint32_t recordBeginOffset = 0;
+		uint32_t recordEndOffset = 0;
+		while (recordWalker.NextRecord(recordBeginOffset, recordEndOffset))
+		{
+			while (fragmentEndOffset <= recordBeginOffset)
+			{
+				fragmentEndOffset += fragments[++fragmentIndex].m_DataSize;
+			}
+
+			// the record is read from the fragment it begins in up to the one it ends in
+			uint64_t numFragmentReads = 1;
+			for (size_t lastFragmentIndex = fragmentIndex, lastFragmentEndOffset = fragmentEndOffset; lastFragmentEndOffset < recordEndOffset; ++numFragmentReads)
+			{
+				lastFragmentEndOffset += fragments[++lastFragmentIndex].m_DataSize;
 			}
+			++outNumRecords;
+			outNumFragmentReads += numFragmentReads;
 		}
+	}
 
-		header.m_NumMSFStreams = numStreams;
+	// per stream role totals of the input and output sizes. chunk data is attributed to the fragments in the chunk by their share of its decompressed size.
+	// for streams made of records, it also shows how many fragments a lookup of a random record decompresses on average.
+	void LogStreamRoleStats(const PDBInputFile& inputFile,
+		const uint32_t blockSize,
+		const std::span<const PDBStreamInfo>& streamInfos,
+		const std::span<const MsfzStream>& streamDescs,
+		const std::span<const MsfzChunk>& chunkDescs,
+		const MsfzHeader& header)
+	{
+		struct StreamRoleStats
+		{
+			uint32_t m_NumStreams = 0;
+			uint64_t m_NumInputBytes = 0;
+			uint32_t m_NumFragments = 0;
+			double m_NumOutputBytes = 0.0;
+			uint64_t m_NumRecords = 0;
+			uint64_t m_NumRecordFragmentReads = 0;
+		};
 
-		// compress the stream directory data if needed and write related values into the header
+		std::vector<StreamRoleStats> roleStats(StreamRole::NumStreamRoles);
+		for (uint32_t streamIndex = 0; streamIndex < streamInfos.size(); ++streamIndex)
 		{
-			LogScoped("Compressing stream directory data");
-			const size_t streamDirectoryDataLength = StrictCastTo<size_t>(streamDirectoryDataStream.GetSize());
-			if (compressionStrategy != CompressionStrategy::NoCompression)
+			StreamRoleStats& stats = roleStats[streamInfos[streamIndex].m_Role];
+			++stats.m_NumStreams;
+			stats.m_NumInputBytes += streamInfos[streamIndex].m_StreamSize;
+			for (const MsfzFragment& fragment : streamDescs[streamIndex].m_Fragments)
 			{
-				std::vector<uint8_t> compressedStreamDirectoryData(ZSTD_compressBound(streamDirectoryDataLength));
-				const size_t compressedStreamDirectoryDataLength = ZSTD_compress(
-					compressedStreamDirectoryData.data(),
-					compressedStreamDirectoryData.size(),
-					streamDirectoryDataStream.GetData(),
-					streamDirectoryDataLength,
-					3);
-				if (ZSTD_isError(compressedStreamDirectoryDataLength))
+				++stats.m_NumFragments;
+				if (!fragment.IsLocatedInChunk())
 				{
-					ThrowError("Error when compressing data: 0x%llx", compressedStreamDirectoryDataLength);
+					stats.m_NumOutputBytes += fragment.m_DataSize;
+					continue;
 				}
-				compressedStreamDirectoryData.resize(compressedStreamDirectoryDataLength);
-				outDirectoryDataStream.WriteSpan<uint8_t>(compressedStreamDirectoryData);
-				header.m_IsStreamDirectoryDataCompressed = true;
+				const MsfzChunk& chunkDesc = chunkDescs[fragment.GetChunkIndex()];
+				stats.m_NumOutputBytes += chunkDesc.m_CompressedSize * (fragment.m_DataSize * 1.0 / chunkDesc.m_DecompressedSize);
+			}
+			CountRecordLookups(inputFile, streamInfos[streamIndex], blockSize, streamDescs[streamIndex].m_Fragments, stats.m_NumRecords, stats.m_NumRecordFragmentReads);
+		}
+
+		LogInfo("Streams by role:");
+		LogInfo("%13s | %8s | %14s | %10s | %14s | %7s | %10s | %13s", "Role", "Streams", "Input bytes", "Fragments", "Output bytes", "Ratio", "Records", "Frags/lookup");
+		for (uint32_t role = 0; role < StreamRole::NumStreamRoles; ++role)
+		{
+			const StreamRoleStats& stats = roleStats[role];
+			if (stats.m_NumStreams == 0)
+			{
+				continue;
+			}
+			const double outputRatio = stats.m_NumInputBytes != 0 ? stats.m_NumOutputBytes * 100.0 / stats.m_NumInputBytes : 0.0;
+			if (stats.m_NumRecords != 0)
+			{
+				LogInfo("%13s | %8u | %14llu | %10u | %14.0f | %6.2f%% | %10llu | %13.3f", g_StreamRoleNames[role], stats.m_NumStreams, stats.m_NumInputBytes, stats.m_NumFragments,
+					stats.m_NumOutputBytes, outputRatio, stats.m_NumRecords, stats.m_NumRecordFragmentReads * 1.0 / stats.m_NumRecords);
 			}
 			else
 			{
-				outDirectoryDataStream = std::move(streamDirectoryDataStream);
-				header.m_IsStreamDirectoryDataCompressed = false;
+				LogInfo("%13s | %8u | %14llu | %10u | %14.0f | %6.2f%% | %10s | %13s", g_StreamRoleNames[role], stats.m_NumStreams, stats.m_NumInputBytes, stats.m_NumFragments,
+					stats.m_NumOutputBytes, outputRatio, "-", "-");
 			}
 		}
+		const size_t numRawChunks = std::count_if(chunkDescs.begin(), chunkDescs.end(), [](const MsfzChunk& chunkDesc) { return !chunkDesc.m_IsCompressed; });
+		LogInfo("Stream directory: %u bytes, chunk metadata: %u bytes (%u chunks, %zu stored raw)", header.m_StreamDirectoryDataLengthCompressed, header.m_ChunkMetadataLength, header.m_NumChunks, numRawChunks);
 	}
 
 	void RunCompression(const ProgramCommandLineArgs& args)
 	{
-		SimpleWinFile pdbFile(args.m_InputFilePath.c_str());
+		PDBInputFile inputFile(args.m_InputFilePath.c_str());
 		{
 			LogScoped("Opening input file");
-			if (!pdbFile.Open(false))
+			const uint64_t inputMemoryLimit = static_cast<uint64_t>(args.m_InputMemoryLimitMB.value_or(0u)) << 20;
+			if (!inputFile.Open(inputMemoryLimit))
 			{
 				ThrowError("Unable to open input file.");
 			}
 		}
 
-		ImmutableStream fileStream(pdbFile.GetData(), pdbFile.GetSize());
 		{
-			const PDBSuperBlock* pdbSuperblock = fileStream.Peek<PDBSuperBlock>();
-			if (pdbSuperblock == nullptr)
+			PDBSuperBlock pdbSuperblock = {};
+			if (!inputFile.ReadBytes(0, &pdbSuperblock, sizeof(PDBSuperBlock)))
 			{
 				ThrowError("Unable to read PDB superblock from the input file.");
 			}
-			if (memcmp(pdbSuperblock->m_Signature, g_PdbSignatureBytes, sizeof(g_PdbSignatureBytes)) != 0)
+			if (memcmp(pdbSuperblock.m_Signature, g_PdbSignatureBytes, sizeof(g_PdbSignatureBytes)) != 0)
 			{
 				ThrowError("Input file is not a PDB file.");
 			}
@@ -361,37 +2341,52 @@ namespace Compression
 			std::vector<PDBStreamInfo> streamInfos;
 			{
 				LogScoped("Parsing stream directory");
-				ParseStreamDirectory(fileStream, pdbSuperblock, streamInfos);
+				ParseStreamDirectory(inputFile, &pdbSuperblock, streamInfos);
+			}
+			{
+				LogScoped("Classifying streams");
+				ClassifyStreams(inputFile, pdbSuperblock.m_BlockSize, streamInfos);
+			}
+
+			std::vector<CompressionPolicyRule> compressionPolicyRules;
+			if (args.m_CompressionPolicy.has_value())
+			{
+				LoadCompressionPolicy(args.m_CompressionPolicy.value(), compressionPolicyRules);
 			}
+			ResolveStreamCompressionSettings(args, compressionPolicyRules, streamInfos);
 
-			uint32_t numBytesForDirectoryData = 0;
-			uint32_t numBytesForChunkDescriptors = 0;
-			uint32_t numBytesForChunkDataMax = 0;		// note: this is the maximum amount of bytes, not the actual amount of byte that chunk data will take up
-			CalculateOutputRegionSizes(streamInfos, args, numBytesForDirectoryData, numBytesForChunkDescriptors, numBytesForChunkDataMax);
+			std::vector<MsfzStream> streamDescriptors;
+			std::vector<FragmentRangeTask> fragmentRangeTasks;
+			const uint32_t numChunks = PlanStreamFragments(inputFile, streamInfos, pdbSuperblock.m_BlockSize, args, streamDescriptors, fragmentRangeTasks);
+			const uint32_t numBytesForChunkDescriptors = numChunks * sizeof(MsfzChunk);
 
-			SimpleWinFile outputFile(args.m_OutputFilePath.c_str());
+			SimpleFile outputFile(args.m_OutputFilePath.c_str());
 			{
 				LogScoped("Opening output file");
 				if (!outputFile.Open(true))
 				{
 					ThrowError("Unable to open the output file for writing.");
 				}
-
-				const size_t outputFileSize = sizeof(MsfzHeader) + numBytesForDirectoryData + numBytesForChunkDescriptors + numBytesForChunkDataMax;
-				if (!outputFile.Resize(outputFileSize))
-				{
-					ThrowError("Unable to resize the output file. Size = %llu", outputFileSize);
-				}
 			}
 
-			// we serialize diferrent parts of data as: chunk metadata (descriptors) - chunk data - directory stream data. this is because:
-			// 1) chunk metadata length can be easily calculated upfront, this gives a fixed offset in the output file where chunk data will reside
-			// and allows us to write directly into the output file rather than using intermediate buffers.
-			// 2) both chunk data and directory stream data can have variable length so we can't calculate a fixed offset
-			// for at least one of them and must write it into an intermediate buffer. the easy choice is directory stream data, as it's much shorter than chunk data.
-			const uint32_t chunkMetadataOffset = sizeof(MsfzHeader);
-			const uint32_t chunkDataOffset = chunkMetadataOffset + numBytesForChunkDescriptors;
-			// const uint32_t directoryDataOffset = ??? - to calculate after initial writing is done
+			// we serialize diferrent parts of data as: header - chunk metadata (descriptors) - raw stream data - chunk data - directory stream data. the output file is
+			// written front to back, rather than being sized for the worst case upfront:
+			// 1) header and chunk metadata lengths are known upfront, so their region is only reserved and filled in once everything else is done.
+			// chunk descriptors are collected in memory meanwhile. tiny streams that are stored outside of chunks follow right away, so that
+			// reading them when the PDB is opened doesn't take more than the first few pages of the file.
+			// 2) chunk data is appended as chunks get compressed, so the file (and the page cache) only ever holds as many bytes as the chunks actually take up.
+			// 3) directory stream data goes at the very end.
+			// with --raw_chunk_alignment, raw chunks start at aligned offsets and the other chunks fill the gaps in front of them (see ChunkDataSlab).
+			// with the LoadOrder layout, the directory goes right after the chunk metadata instead, followed by the chunks that are read when the PDB is
+			// opened. that way opening the PDB reads one contiguous prefix of the file rather than seeking all over it, which matters on network shares and
+			// cold caches. the directory only depends on where the chunks go, not on their contents, so it can be written before any chunk is compressed.
+			BufferedFileWriter outputFileWriter(outputFile);
+			uint64_t headerAndChunkMetadataOffset = 0;
+			if (!outputFileWriter.Reserve(sizeof(MsfzHeader) + numBytesForChunkDescriptors, headerAndChunkMetadataOffset))
+			{
+				ThrowError("Unable to write to the output file.");
+			}
+			WriteRawStreamData(inputFile, streamInfos, streamDescriptors, pdbSuperblock.m_BlockSize, outputFileWriter);
 
 			MsfzHeader header = {};
 			static_assert(sizeof(MsfzHeader::m_Signature) == sizeof(g_MsfzSignatureBytes));
@@ -400,40 +2395,65 @@ namespace Compression
 			// chunk metadata info, we calculated this upfront
 			header.m_ChunkMetadataOffset = sizeof(MsfzHeader);
 			header.m_ChunkMetadataLength = numBytesForChunkDescriptors;
-			header.m_NumChunks = header.m_ChunkMetadataLength / sizeof(MsfzChunk);
+			header.m_NumChunks = numChunks;
 
-			// main compression
-			MutableStreamFixed outputFileStream(outputFile.GetData(), outputFile.GetSize());
 			MutableStreamDynamic directoryDataStream;
-			SimpleMutableStreamFixedThreadSafe chunkMetadataStream = outputFileStream.GetStreamAtOffset(header.m_ChunkMetadataOffset);
-			SimpleMutableStreamFixedThreadSafe chunkDataStream = outputFileStream.GetStreamAtOffset(chunkDataOffset, numBytesForChunkDataMax);
-			CompressAndWriteStreamData(fileStream, streamInfos, args, pdbSuperblock->m_BlockSize, chunkDataOffset, header, directoryDataStream, chunkMetadataStream, chunkDataStream);
-
-			// now we know stream data + directory offsets and size
-			const uint32_t streamDataFinalSize = StrictCastTo<uint32_t>(chunkDataStream.GetOffset());
-			const uint32_t directoryDataOffset = StrictCastTo<uint32_t>(chunkDataOffset + streamDataFinalSize);
+			BuildStreamDirectory(streamDescriptors, args, header, directoryDataStream);
 			const uint32_t directoryDataFinalSize = StrictCastTo<uint32_t>(directoryDataStream.GetSize());
-			MutableStreamFixed directoryDataStreamFinal = outputFileStream.GetStreamAtOffset(directoryDataOffset, directoryDataFinalSize);
-			directoryDataStreamFinal.WriteSpan<uint8_t>({ directoryDataStream.GetData(), directoryDataFinalSize });
+			const auto writeDirectoryData = [&outputFileWriter, &directoryDataStream, directoryDataFinalSize]() -> uint32_t
+				{
+					const uint32_t directoryDataOffset = StrictCastTo<uint32_t>(outputFileWriter.GetOffset());
+					if (!outputFileWriter.Append(directoryDataStream.GetData(), directoryDataFinalSize))
+					{
+						ThrowError("Unable to write directory data to the output file.");
+					}
+					return directoryDataOffset;
+				};
+
+			const bool isDirectoryBeforeChunkData = args.m_ChunkLayout.value_or(ChunkLayout::StreamOrder) == ChunkLayout::LoadOrder;
+			uint32_t directoryDataOffset = isDirectoryBeforeChunkData ? writeDirectoryData() : 0u;
+
+			// main compression
+			std::vector<MsfzChunk> chunkDescriptors(header.m_NumChunks);
+			const MutableStreamFixed chunkMetadataStream(chunkDescriptors.data(), numBytesForChunkDescriptors);
+			ChunkDataWriter chunkDataWriter(outputFileWriter, args.m_RawChunkAlignment.value_or(0u));
+			CompressAndWriteStreamData(inputFile, streamInfos, streamDescriptors, fragmentRangeTasks, pdbSuperblock.m_BlockSize, chunkMetadataStream, chunkDataWriter);
+			if (chunkDataWriter.GetRawChunkAlignment() != 0)
+			{
+				LogInfo("Aligned %u raw chunks to %u bytes, with %llu bytes of padding.", chunkDataWriter.GetNumAlignedChunks(), chunkDataWriter.GetRawChunkAlignment(), chunkDataWriter.GetNumPaddingBytes());
+			}
+
+			if (!isDirectoryBeforeChunkData)
+			{
+				directoryDataOffset = writeDirectoryData();
+			}
+			if (!outputFileWriter.Flush())
+			{
+				ThrowError("Unable to write directory data to the output file.");
+			}
 
 			// directory stuff in the header
 			header.m_StreamDirectoryDataOffset = directoryDataOffset;
 			header.m_StreamDirectoryDataOrigin = 0;
 			header.m_StreamDirectoryDataLengthCompressed = StrictCastTo<uint32_t>(directoryDataFinalSize);
-			header.m_StreamDirectoryDataLengthDecompressed = StrictCastTo<uint32_t>(numBytesForDirectoryData);
 
-			// write the header
-			MutableStreamFixed headerStream = outputFileStream.GetStreamAtOffset(0u, sizeof(MsfzHeader));
-			headerStream.Write(header);
-
-			// finally, resize the file to its real length
-			const uint64_t realFileLength = sizeof(MsfzHeader) + numBytesForChunkDescriptors + streamDataFinalSize + directoryDataFinalSize;
-			outputFile.Resize(realFileLength);
+			// finally, fill in the header and the chunk metadata
+			if (!outputFileWriter.WriteAt(headerAndChunkMetadataOffset, &header, sizeof(MsfzHeader))
+				|| !outputFileWriter.WriteAt(header.m_ChunkMetadataOffset, chunkDescriptors.data(), numBytesForChunkDescriptors))
+			{
+				ThrowError("Unable to write the header to the output file.");
+			}
 
+			const uint64_t realFileLength = outputFileWriter.GetOffset();
 			LogInfo("Input file size = %.2fMB, Output file size = %.2fMB. Compression ratio = %.2f%%\r\n",
-				pdbFile.GetSize() * 1.0f / (1 << 20),
+				inputFile.GetSize() * 1.0f / (1 << 20),
 				realFileLength * 1.0f / (1 << 20),
-				realFileLength * 100.0f / pdbFile.GetSize());
+				realFileLength * 100.0f / inputFile.GetSize());
+
+			if (args.m_PrintStats)
+			{
+				LogStreamRoleStats(inputFile, pdbSuperblock.m_BlockSize, streamInfos, streamDescriptors, chunkDescriptors, header);
+			}
 		}
 	}
 }
\ No newline at end of file
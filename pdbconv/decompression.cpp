@@ -10,8 +10,10 @@
 
 #include <zstd.h>
 #include <map>
+#include <memory>
 #include <fstream>
 #include <numeric>
+#include <mutex>
 
 using namespace ynw;
 
@@ -25,130 +27,127 @@ namespace Decompression
 	constexpr uint32_t k_MaxNumStreams = 0x10000;
 	constexpr uint32_t k_MaxNumBlocks = 1u << 20;
 
-	// This stream class handles "holes" in a contiguous block of data we're supposed to write to
-	// i.e. because we have blocks we can't use (FPM blocks), we need to make sure that no data is written there
-	class MutableStreamFixedWithHoles : public MutableStreamFixed
+	// Writes a MSF stream straight into the blocks it's been assigned in the output file. Logical stream offsets are mapped to
+	// blocks by indexing into the stream's block list, so every write costs one memcpy per (run of consecutive) block(s) touched,
+	// regardless of how many blocks the stream has or how they're spread around the file.
+	class MsfBlockStreamWriter : public MutableStreamFixed
 	{
 	public:
-		using MutableStreamFixed::MutableStreamFixed;
-
-		MutableStreamFixedWithHoles(MutableStreamFixed&& sourceStream)
-			: MutableStreamFixed(sourceStream)
-		{
-		}
-
-		void AddHole(const uint64_t beginOffset, const uint64_t endOffset)
+		MsfBlockStreamWriter(const MutableStreamFixed& outputFileStream, const std::span<const uint32_t>& blockIndices, const uint32_t blockSize, const uint64_t baseOffset = 0, const uint64_t size = 0)
+			: MutableStreamFixed(outputFileStream.GetData(), size != 0 ? size : static_cast<uint64_t>(blockIndices.size()) * blockSize - baseOffset)
+			, m_FileSize(outputFileStream.GetSize())
+			, m_BlockIndices(blockIndices)
+			, m_BlockSize(blockSize)
+			, m_BaseOffset(baseOffset)
 		{
-			assert(beginOffset < GetSize() && endOffset <= GetSize());
-			m_HoleOffsets.emplace_back(beginOffset, endOffset);
+			assert(m_BaseOffset + m_Size <= static_cast<uint64_t>(blockIndices.size()) * blockSize);
 		}
 
 		bool WriteBytes(const void* data, size_t dataLengthInBytes) override
 		{
-			std::vector<std::pair<uint64_t, uint64_t>> writeSpans = AdjustWriteSpans(m_Offset, m_Offset + dataLengthInBytes);
-			if (writeSpans.back().second > AdjustOffset(m_Size))
+			if (m_Offset + dataLengthInBytes > m_Size)
 			{
 				assert(false);
 				return false;
 			}
 
 			const uint8_t* srcData = reinterpret_cast<const uint8_t*>(data);
-			for (const auto& span : writeSpans)
+			while (dataLengthInBytes > 0)
 			{
-				const uint64_t numBytesToWrite = span.second - span.first;
-				memcpy(m_Data + span.first, srcData, StrictCastTo<size_t>(numBytesToWrite));
-				srcData += numBytesToWrite;
+				const std::span<uint8_t> destination = GetContiguousSpanAt(m_BaseOffset + m_Offset, dataLengthInBytes);
+				memcpy(destination.data(), srcData, destination.size());
+				srcData += destination.size();
+				dataLengthInBytes -= destination.size();
+				m_Offset += destination.size();
 			}
-			m_Offset += dataLengthInBytes;
 			return true;
 		}
 
-		MutableStreamFixedWithHoles GetSubStreamAtOffset(uint64_t offset, uint64_t size = 0) const
+		// returns the output bytes backing up to maxNumBytes next bytes of the stream, so that they can be written in place, and moves past them
+		std::span<uint8_t> GetNextSpanForWriting(const size_t maxNumBytes)
+		{
+			assert(m_Offset + maxNumBytes <= m_Size);
+			const std::span<uint8_t> destination = GetContiguousSpanAt(m_BaseOffset + m_Offset, maxNumBytes);
+			m_Offset += destination.size();
+			return destination;
+		}
+
+		MsfBlockStreamWriter GetSubStreamAtOffset(uint64_t offset, uint64_t size = 0) const
 		{
 			if (size == 0)
 			{
 				size = m_Size - offset;
 			}
-
-			const uint64_t realOffset = AdjustOffset(offset);
-			const uint64_t realSize = AdjustOffset(offset + size) - realOffset;
-			MutableStreamFixedWithHoles resultStream = MutableStreamFixed::GetStreamAtOffset(realOffset, size);
-			for (const auto& offsetPair : m_HoleOffsets)
-			{
-				const uint64_t beginOffsetClamped = std::clamp(offsetPair.first, realOffset, realOffset + realSize);
-				const uint64_t endOffsetClamped = std::clamp(offsetPair.second, realOffset, realOffset + realSize);
-				if (beginOffsetClamped != endOffsetClamped)
-				{
-					resultStream.AddHole(beginOffsetClamped - realOffset, endOffsetClamped - realOffset);
-				}
-			}
-			return resultStream;
+			assert(offset + size <= m_Size);
+			return MsfBlockStreamWriter(MutableStreamFixed(m_Data, m_FileSize), m_BlockIndices, m_BlockSize, m_BaseOffset + offset, size);
 		}
 
 	private:
 		// disallow the normal stream splitting, as it returns a contiguous stream
 		using MutableStreamFixed::GetStreamAtOffset;
 
-		std::vector<std::pair<uint64_t, uint64_t>> AdjustWriteSpans(uint64_t beginSpan, uint64_t endSpan) const
+		// returns the output bytes that back up to maxNumBytes of the stream starting at streamOffset, extended over consecutive blocks
+		std::span<uint8_t> GetContiguousSpanAt(const uint64_t streamOffset, const size_t maxNumBytes) const
 		{
-			std::vector<std::pair<uint64_t, uint64_t>> resultWriteSpans;
-			uint64_t currentBeginSpan = AdjustOffset(beginSpan);
-			uint64_t currentEndSpan = AdjustOffset(endSpan);
-			for (const auto& offsetPair : m_HoleOffsets)
+			const size_t firstBlock = StrictCastTo<size_t>(streamOffset / m_BlockSize);
+			const uint64_t offsetInFirstBlock = streamOffset % m_BlockSize;
+			size_t lastBlock = firstBlock;
+			while ((lastBlock + 1 - firstBlock) * m_BlockSize - offsetInFirstBlock < maxNumBytes && m_BlockIndices[lastBlock + 1] == m_BlockIndices[lastBlock] + 1)
 			{
-				if (offsetPair.first >= currentBeginSpan && offsetPair.first < currentEndSpan)
-				{
-					if (currentBeginSpan != offsetPair.first)
-					{
-						resultWriteSpans.emplace_back(currentBeginSpan, offsetPair.first);
-					}
-					currentBeginSpan = offsetPair.second;
-				}
+				++lastBlock;
 			}
-			assert(currentBeginSpan <= currentEndSpan);
-			resultWriteSpans.emplace_back(currentBeginSpan, currentEndSpan);
-			return resultWriteSpans;
-		}
 
-		uint64_t AdjustOffset(uint64_t offset) const
-		{
-			uint64_t resultOffset = offset;
-			for (const auto& offsetPair : m_HoleOffsets)
-			{
-				if (offsetPair.first <= resultOffset)
-				{
-					resultOffset += offsetPair.second - offsetPair.first;
-				}
-			}
-			return resultOffset;
+			const size_t numBytes = StrictCastTo<size_t>(std::min<uint64_t>((lastBlock + 1 - firstBlock) * m_BlockSize - offsetInFirstBlock, maxNumBytes));
+			const uint64_t fileOffset = static_cast<uint64_t>(m_BlockIndices[firstBlock]) * m_BlockSize + offsetInFirstBlock;
+			assert(fileOffset + numBytes <= m_FileSize);
+			return { m_Data + fileOffset, numBytes };
 		}
 
-		std::vector<std::pair<uint64_t, uint64_t>> m_HoleOffsets;
+		uint64_t m_FileSize = 0;
+		std::span<const uint32_t> m_BlockIndices;
+		uint32_t m_BlockSize = 0;
+		uint64_t m_BaseOffset = 0;
 	};
 
-	MutableStreamFixedWithHoles GetStreamFromBlockIndices(const MutableStreamFixed& sourceStream, const std::vector<uint32_t>& blockIndices, const uint32_t blockSize)
+	// One zstd decompression context per worker thread, kept for the whole run so that decompressing a chunk doesn't create
+	// a fresh context like one-shot ZSTD_decompress does. Chunks are currently always raw zstd frames, but a dictionary
+	// can be referenced by every context if the format ever starts carrying one.
+	// Each worker creates its context on first use, so that it's allocated on the worker's NUMA node when workers are pinned.
+	class DecompressionContextPool
 	{
-		if (blockIndices.size() == 0)
+	public:
+		DecompressionContextPool(const uint32_t numWorkers, const ZSTD_DDict* dictionary = nullptr)
+			: m_Dictionary(dictionary)
 		{
-			return MutableStreamFixedWithHoles{ nullptr, 0 };
+			m_Contexts.reserve(numWorkers);
+			for (uint32_t i = 0; i < numWorkers; ++i)
+			{
+				m_Contexts.emplace_back(nullptr, &ZSTD_freeDCtx);
+			}
 		}
 
-		const uint32_t firstBlockIndex = blockIndices.front();
-		const uint32_t lastBlockIndex = blockIndices.back();
-		MutableStreamFixedWithHoles resultStream = sourceStream.GetStreamAtOffset(blockSize * firstBlockIndex, (lastBlockIndex - firstBlockIndex + 1) * blockSize);
-		uint32_t prevRelBlockIndex = 0;
-		for (uint32_t i = 1; i < blockIndices.size(); ++i)
+		ZSTD_DCtx* GetForCurrentWorker() const
 		{
-			const uint32_t relBlockIndex = blockIndices[i] - firstBlockIndex;
-			if (relBlockIndex != prevRelBlockIndex + 1)
+			std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)>& workerContext = m_Contexts[WorkerThread::GetIndex()];
+			if (workerContext == nullptr)
 			{
-				resultStream.AddHole((prevRelBlockIndex + 1) * blockSize, relBlockIndex * blockSize);
+				workerContext.reset(ZSTD_createDCtx());
+				if (workerContext == nullptr)
+				{
+					ThrowError("Unable to create a decompression context.");
+				}
+				if (m_Dictionary != nullptr)
+				{
+					ZSTD_DCtx_refDDict(workerContext.get(), m_Dictionary);
+				}
 			}
-			prevRelBlockIndex = relBlockIndex;
+			return workerContext.get();
 		}
 
-		return resultStream;
-	}
+	private:
+		mutable std::vector<std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)>> m_Contexts;	// only ever touched by the worker they belong to
+		const ZSTD_DDict* m_Dictionary = nullptr;
+	};
 
 	bool IsBlockReserved(const uint32_t blockIndex, const uint32_t blockSize)
 	{
@@ -311,70 +310,250 @@ namespace Decompression
 		outNumBlocks = maxBlockIndex;
 	}
 
-	void WriteSingleStreamDataToPDB(ImmutableStream& msfzFileStream,
-		const std::span<const MsfzChunk>& chunkDescriptors,
-		const MsfzStream& streamDesc,
-		MutableStreamFixed& outputStream)
+	// decompresses a whole chunk straight into the output stream. chunks that land in a single run of output blocks are decoded in one go,
+	// otherwise the output buffer handed to zstd's streaming API moves from one run of blocks to the next as they fill up.
+	void DecompressChunkIntoStream(ZSTD_DCtx* decompressionContext, const std::span<const uint8_t>& compressedChunkData, const uint32_t decompressedSize, MsfBlockStreamWriter& outputStream)
 	{
-		uint64_t totalStreamSize = 0;
-		for (const MsfzFragment& fragmentDesc : streamDesc.m_Fragments)
+		std::span<uint8_t> destination = outputStream.GetNextSpanForWriting(decompressedSize);
+		if (destination.size() == decompressedSize)
 		{
-			ReadOnlyVector<uint8_t> fragmentData;
-			ReadOnlyVector<uint8_t> chunkData;
-			if (!fragmentDesc.IsLocatedInChunk())
+			const size_t decompressedSizeResult = ZSTD_decompressDCtx(decompressionContext, destination.data(), destination.size(), compressedChunkData.data(), compressedChunkData.size());
+			if (ZSTD_isError(decompressedSizeResult))
 			{
-				// fragment is located in the first page
-				if (!msfzFileStream.CanRead(fragmentDesc.m_DataOffset, fragmentDesc.m_DataSize))
-				{
-					ThrowError("Invalid data. Offset in first page cannot be seeked to.");
-				}
-
-				fragmentData.AssignNonOwned({ msfzFileStream.PeekAtOffset<uint8_t>(fragmentDesc.m_DataOffset), fragmentDesc.m_DataSize });
+				ThrowError("Error when decompressing stream data: %s", ZSTD_getErrorName(decompressedSizeResult));
 			}
-			else
+			if (decompressedSizeResult < decompressedSize)
 			{
-				const uint32_t chunkIndex = fragmentDesc.GetChunkIndex();
-				if (chunkIndex >= chunkDescriptors.size())
+				ThrowError("Error when decompressing stream data. Decompressed length is not equal to expected length: %u vs %u", decompressedSizeResult, decompressedSize);
+			}
+			return;
+		}
+
+		ZSTD_DCtx_reset(decompressionContext, ZSTD_reset_session_only);
+		ZSTD_inBuffer inputBuffer = { compressedChunkData.data(), compressedChunkData.size(), 0 };
+		size_t numBytesLeft = decompressedSize;
+		bool isFrameComplete = false;
+		while (true)
+		{
+			ZSTD_outBuffer outputBuffer = { destination.data(), destination.size(), 0 };
+			while (outputBuffer.pos < outputBuffer.size)
+			{
+				const size_t prevInputPos = inputBuffer.pos;
+				const size_t prevOutputPos = outputBuffer.pos;
+				const size_t result = ZSTD_decompressStream(decompressionContext, &outputBuffer, &inputBuffer);
+				if (ZSTD_isError(result))
 				{
-					ThrowError("Invalid chunk index specified in a fragment descriptor. Index = %u, Number of chunks = %llu", chunkIndex, chunkDescriptors.size());
+					ThrowError("Error when decompressing stream data: %s", ZSTD_getErrorName(result));
 				}
-				const MsfzChunk& chunkDesc = chunkDescriptors[chunkIndex];
-				if (fragmentDesc.m_DataOffset > chunkDesc.m_DecompressedSize || fragmentDesc.m_DataOffset + fragmentDesc.m_DataSize > chunkDesc.m_DecompressedSize)
+				if (outputBuffer.pos < outputBuffer.size && (result == 0 || (inputBuffer.pos == prevInputPos && outputBuffer.pos == prevOutputPos)))
 				{
-					ThrowError("Invalid data. Fragment goes out of bounds of its corresponding chunk.");
+					ThrowError("Error when decompressing stream data. Decompressed length is less than expected length: %u", decompressedSize);
 				}
-				
-				if (!msfzFileStream.CanRead(chunkDesc.m_OffsetToChunkData, chunkDesc.m_CompressedSize))
+				isFrameComplete = result == 0;
+			}
+
+			numBytesLeft -= destination.size();
+			if (numBytesLeft == 0)
+			{
+				break;
+			}
+			destination = outputStream.GetNextSpanForWriting(numBytesLeft);
+		}
+
+		// the output is full, so the frame has to end right here, with nothing left to decompress and no compressed data after it
+		if (!isFrameComplete)
+		{
+			ZSTD_outBuffer noOutputBuffer = { nullptr, 0, 0 };
+			const size_t result = ZSTD_decompressStream(decompressionContext, &noOutputBuffer, &inputBuffer);
+			if (ZSTD_isError(result))
+			{
+				ThrowError("Error when decompressing stream data: %s", ZSTD_getErrorName(result));
+			}
+			isFrameComplete = result == 0;
+		}
+		if (!isFrameComplete || inputBuffer.pos != inputBuffer.size)
+		{
+			ThrowError("Error when decompressing stream data. Decompressed length is greater than expected length: %u", decompressedSize);
+		}
+	}
+
+	// A range of consecutive fragments of one stream, along with where the first of them starts in the stream. Streams are cut into
+	// ranges of about k_TargetNumBytes so that the fragments of one huge stream are spread over all worker threads, rather than
+	// leaving a single thread to decompress most of the file.
+	struct FragmentRangeTask
+	{
+		static constexpr uint64_t k_TargetNumBytes = 1u << 20;
+
+		uint32_t m_StreamIndex = 0;
+		uint32_t m_FirstFragmentIndex = 0;
+		uint32_t m_NumFragments = 0;
+		uint64_t m_OffsetInStream = 0;
+		uint64_t m_NumBytes = 0;
+	};
+
+	void SplitStreamsIntoFragmentRanges(const std::span<const MsfzStream>& streamDescriptors, std::vector<FragmentRangeTask>& outTasks)
+	{
+		for (uint32_t streamIndex = 0; streamIndex < streamDescriptors.size(); ++streamIndex)
+		{
+			const std::vector<MsfzFragment>& fragments = streamDescriptors[streamIndex].m_Fragments;
+			uint64_t offsetInStream = 0;
+			for (uint32_t fragmentIndex = 0; fragmentIndex < fragments.size(); ++fragmentIndex)
+			{
+				if (fragmentIndex == 0 || outTasks.back().m_NumBytes >= FragmentRangeTask::k_TargetNumBytes)
 				{
-					ThrowError("Invalid data. Chunk is located outside of bounds of the file.");
+					outTasks.push_back({ streamIndex, fragmentIndex, 0, offsetInStream, 0 });
 				}
+				FragmentRangeTask& task = outTasks.back();
+				++task.m_NumFragments;
+				task.m_NumBytes += fragments[fragmentIndex].m_DataSize;
+				offsetInStream += fragments[fragmentIndex].m_DataSize;
+			}
+		}
+	}
 
-				if (chunkDesc.m_IsCompressed)
-				{
-					std::vector<uint8_t> decompressedChunkData(chunkDesc.m_DecompressedSize);
-					const size_t decompressedSizeResult = ZSTD_decompress(decompressedChunkData.data(), decompressedChunkData.size(), msfzFileStream.PeekAtOffset<uint8_t>(chunkDesc.m_OffsetToChunkData), chunkDesc.m_CompressedSize);
+	void DecompressChunkIntoBuffer(ZSTD_DCtx* decompressionContext, const std::span<const uint8_t>& chunkDataInFile, const uint32_t decompressedSize, uint8_t* outData)
+	{
+		const size_t decompressedSizeResult = ZSTD_decompressDCtx(decompressionContext, outData, decompressedSize, chunkDataInFile.data(), chunkDataInFile.size());
+		if (ZSTD_isError(decompressedSizeResult))
+		{
+			ThrowError("Error when decompressing stream data: %s", ZSTD_getErrorName(decompressedSizeResult));
+		}
+		if (decompressedSizeResult < decompressedSize)
+		{
+			ThrowError("Error when decompressing stream data. Decompressed length is not equal to expected length: %u vs %u", decompressedSizeResult, decompressedSize);
+		}
+	}
 
-					if (ZSTD_isError(decompressedSizeResult))
-					{
-						ThrowError("Error when decompressing stream data: %s", ZSTD_getErrorName(decompressedSizeResult));
-					}
-					if (decompressedSizeResult < chunkDesc.m_DecompressedSize)
+	// Compressed chunks that more than one fragment points into, e.g. chunks packed with small streams, are decompressed once by the first
+	// worker that needs them and kept until the last of their fragments has been written, instead of being decompressed again for every fragment.
+	class SharedChunkCache
+	{
+	public:
+		SharedChunkCache(const std::span<const MsfzStream>& streamDescriptors, const std::span<const MsfzChunk>& chunkDescriptors)
+			: m_Entries(chunkDescriptors.size())
+		{
+			for (const MsfzStream& streamDesc : streamDescriptors)
+			{
+				for (const MsfzFragment& fragmentDesc : streamDesc.m_Fragments)
+				{
+					if (fragmentDesc.IsLocatedInChunk() && fragmentDesc.GetChunkIndex() < chunkDescriptors.size())
 					{
-						ThrowError("Error when decompressing stream data. Decompressed length is not equal to expected length: %u vs %u", decompressedSizeResult, chunkDesc.m_DecompressedSize);
+						++m_Entries[fragmentDesc.GetChunkIndex()].m_NumFragments;
 					}
-					chunkData.AssignOwned(decompressedChunkData);
 				}
-				else
+			}
+			for (Entry& entry : m_Entries)
+			{
+				entry.m_NumFragmentsLeft = entry.m_NumFragments;
+			}
+		}
+
+		// decided by the total fragment count, which never changes, so every fragment of a shared chunk acquires and releases it
+		bool IsShared(const uint32_t chunkIndex) const { return m_Entries[chunkIndex].m_NumFragments > 1; }
+
+		// returns the decompressed chunk, which stays valid until the fragment it's acquired for is released
+		std::span<const uint8_t> Acquire(const uint32_t chunkIndex, ZSTD_DCtx* decompressionContext, const std::span<const uint8_t>& chunkDataInFile, const uint32_t decompressedSize)
+		{
+			Entry& entry = m_Entries[chunkIndex];
+			std::lock_guard<std::mutex> lock(entry.m_Mutex);
+			if (!entry.m_IsDecompressed)
+			{
+				entry.m_Data.resize(decompressedSize);
+				DecompressChunkIntoBuffer(decompressionContext, chunkDataInFile, decompressedSize, entry.m_Data.data());
+				entry.m_IsDecompressed = true;
+			}
+			return entry.m_Data;
+		}
+
+		void Release(const uint32_t chunkIndex)
+		{
+			Entry& entry = m_Entries[chunkIndex];
+			std::lock_guard<std::mutex> lock(entry.m_Mutex);
+			if (--entry.m_NumFragmentsLeft == 0)
+			{
+				std::vector<uint8_t>().swap(entry.m_Data);
+			}
+		}
+
+	private:
+		struct Entry
+		{
+			std::mutex m_Mutex;
+			std::vector<uint8_t> m_Data;
+			uint32_t m_NumFragments = 0;	// only set up front
+			uint32_t m_NumFragmentsLeft = 0;
+			bool m_IsDecompressed = false;
+		};
+
+		std::vector<Entry> m_Entries;
+	};
+
+	void WriteFragmentsToPDB(ImmutableStream& msfzFileStream,
+		const std::span<const MsfzChunk>& chunkDescriptors,
+		const std::span<const MsfzFragment>& fragments,
+		const DecompressionContextPool& decompressionContextPool,
+		SharedChunkCache& sharedChunkCache,
+		std::vector<uint8_t>& chunkScratchBuffer,
+		MsfBlockStreamWriter& outputStream)
+	{
+		for (const MsfzFragment& fragmentDesc : fragments)
+		{
+			if (!fragmentDesc.IsLocatedInChunk())
+			{
+				// fragment is located in the first page
+				if (!msfzFileStream.CanRead(fragmentDesc.m_DataOffset, fragmentDesc.m_DataSize))
 				{
-					// just shallow assign from the file stream
-					chunkData.AssignNonOwned({ msfzFileStream.PeekAtOffset<uint8_t>(chunkDesc.m_OffsetToChunkData), chunkDesc.m_CompressedSize });
+					ThrowError("Invalid data. Offset in first page cannot be seeked to.");
 				}
 
-				fragmentData.AssignNonOwned({ chunkData.GetData() + fragmentDesc.m_DataOffset, fragmentDesc.m_DataSize });
+				outputStream.WriteBytes(msfzFileStream.PeekAtOffset<uint8_t>(fragmentDesc.m_DataOffset), fragmentDesc.m_DataSize);
+				continue;
 			}
 
-			totalStreamSize += fragmentData.GetSize();
-			outputStream.WriteSpan(fragmentData.GetSpan());
+			const uint32_t chunkIndex = fragmentDesc.GetChunkIndex();
+			if (chunkIndex >= chunkDescriptors.size())
+			{
+				ThrowError("Invalid chunk index specified in a fragment descriptor. Index = %u, Number of chunks = %llu", chunkIndex, chunkDescriptors.size());
+			}
+			const MsfzChunk& chunkDesc = chunkDescriptors[chunkIndex];
+			if (fragmentDesc.m_DataOffset > chunkDesc.m_DecompressedSize || fragmentDesc.m_DataOffset + fragmentDesc.m_DataSize > chunkDesc.m_DecompressedSize)
+			{
+				ThrowError("Invalid data. Fragment goes out of bounds of its corresponding chunk.");
+			}
+
+			if (!msfzFileStream.CanRead(chunkDesc.m_OffsetToChunkData, chunkDesc.m_CompressedSize))
+			{
+				ThrowError("Invalid data. Chunk is located outside of bounds of the file.");
+			}
+
+			const std::span<const uint8_t> chunkDataInFile = { msfzFileStream.PeekAtOffset<uint8_t>(chunkDesc.m_OffsetToChunkData), chunkDesc.m_CompressedSize };
+			if (!chunkDesc.m_IsCompressed)
+			{
+				// just copy straight from the file
+				if (fragmentDesc.m_DataOffset + fragmentDesc.m_DataSize > chunkDataInFile.size())
+				{
+					ThrowError("Invalid data. Fragment goes out of bounds of its corresponding chunk.");
+				}
+				outputStream.WriteBytes(chunkDataInFile.data() + fragmentDesc.m_DataOffset, fragmentDesc.m_DataSize);
+			}
+			else if (sharedChunkCache.IsShared(chunkIndex))
+			{
+				const std::span<const uint8_t> chunkData = sharedChunkCache.Acquire(chunkIndex, decompressionContextPool.GetForCurrentWorker(), chunkDataInFile, chunkDesc.m_DecompressedSize);
+				outputStream.WriteBytes(chunkData.data() + fragmentDesc.m_DataOffset, fragmentDesc.m_DataSize);
+				sharedChunkCache.Release(chunkIndex);
+			}
+			else if (fragmentDesc.m_DataOffset == 0 && fragmentDesc.m_DataSize == chunkDesc.m_DecompressedSize)
+			{
+				// the fragment is the whole chunk, which is what pdbconv itself produces unless it packs small streams
+				DecompressChunkIntoStream(decompressionContextPool.GetForCurrentWorker(), chunkDataInFile, chunkDesc.m_DecompressedSize, outputStream);
+			}
+			else
+			{
+				// only a part of the chunk is needed, it has to be decompressed on the side first
+				chunkScratchBuffer.resize(std::max<size_t>(chunkScratchBuffer.size(), chunkDesc.m_DecompressedSize));
+				DecompressChunkIntoBuffer(decompressionContextPool.GetForCurrentWorker(), chunkDataInFile, chunkDesc.m_DecompressedSize, chunkScratchBuffer.data());
+				outputStream.WriteBytes(chunkScratchBuffer.data() + fragmentDesc.m_DataOffset, fragmentDesc.m_DataSize);
+			}
 		}
 	}
 
@@ -388,27 +567,36 @@ namespace Decompression
 		uint32_t& outDirectorySizeInBytes)
 	{
 		const uint32_t numStreams = StrictCastTo<uint32_t>(streamDescriptors.size());
-		LogProgressTracker m_ProgressLog("Converting streams", numStreams);
 
-		// for progress tracking
-		const uint64_t allStreamsSize = std::accumulate(streamDescriptors.begin(), streamDescriptors.end(), 0ull, [](uint64_t sumSoFar, const MsfzStream& desc) { return sumSoFar + desc.CalculateSize(); });
+		// every fragment's location in the output is known upfront, so fragment ranges can be written independently of each other
+		std::vector<FragmentRangeTask> fragmentRangeTasks;
+		SplitStreamsIntoFragmentRanges(streamDescriptors, fragmentRangeTasks);
+		{
+			LogProgressTracker m_ProgressLog("Converting streams", StrictCastTo<uint32_t>(fragmentRangeTasks.size()));
 
-		ParallelForRunner streamConversionRunner(streamDescriptors);
-		streamConversionRunner.SetScoreFunction([](const MsfzStream& element, uint32_t /*elementIndex*/) { return element.CalculateSize(); });
-		streamConversionRunner.Execute([&](const MsfzStream& streamDesc, uint32_t streamIndex)
-			{
-				const std::vector<uint32_t>& blockIndices = blockIndicesForStreams[streamIndex];
-				MutableStreamFixedWithHoles streamDataStream = GetStreamFromBlockIndices(outputFileStream, blockIndices, blockSize);
-				WriteSingleStreamDataToPDB(msfzFileStream, chunkDescriptors, streamDesc, streamDataStream);
+			// for progress tracking
+			const uint64_t allStreamsSize = std::accumulate(fragmentRangeTasks.begin(), fragmentRangeTasks.end(), 0ull, [](uint64_t sumSoFar, const FragmentRangeTask& task) { return sumSoFar + task.m_NumBytes; });
 
-				m_ProgressLog.UpdateProgress(1, streamDescriptors[streamIndex].CalculateSize() * 1.0f / allStreamsSize);
-			});
+			ParallelForRunner<const FragmentRangeTask> fragmentConversionRunner(fragmentRangeTasks);
+			const DecompressionContextPool decompressionContextPool(fragmentConversionRunner.GetNumThreads());
+			SharedChunkCache sharedChunkCache(streamDescriptors, chunkDescriptors);
+			std::vector<std::vector<uint8_t>> chunkScratchBuffers(fragmentConversionRunner.GetNumThreads());
+			fragmentConversionRunner.SetScoreFunction([](const FragmentRangeTask& element, uint32_t /*elementIndex*/) { return StrictCastTo<uint32_t>(element.m_NumBytes); });
+			fragmentConversionRunner.Execute([&](const FragmentRangeTask& task, uint32_t /*taskIndex*/)
+				{
+					const std::span<const MsfzFragment> fragments = std::span<const MsfzFragment>(streamDescriptors[task.m_StreamIndex].m_Fragments).subspan(task.m_FirstFragmentIndex, task.m_NumFragments);
+					MsfBlockStreamWriter streamDataStream(outputFileStream, blockIndicesForStreams[task.m_StreamIndex], blockSize);
+					streamDataStream.Seek(task.m_OffsetInStream);
+					WriteFragmentsToPDB(msfzFileStream, chunkDescriptors, fragments, decompressionContextPool, sharedChunkCache, chunkScratchBuffers[WorkerThread::GetIndex()], streamDataStream);
 
+					m_ProgressLog.UpdateProgress(1, task.m_NumBytes * 1.0f / allStreamsSize);
+				});
+		}
 
 		// split the directory data stream into two streams: one for stream sizes and another for block indices
-		MutableStreamFixedWithHoles directoryDataStream = GetStreamFromBlockIndices(outputFileStream, blockIndicesForDirectory, blockSize);
-		MutableStreamFixedWithHoles streamSizesStream = directoryDataStream.GetSubStreamAtOffset(sizeof(uint32_t), numStreams * sizeof(uint32_t));
-		MutableStreamFixedWithHoles blockIndicesStream = directoryDataStream.GetSubStreamAtOffset(sizeof(uint32_t) + numStreams * sizeof(uint32_t));
+		MsfBlockStreamWriter directoryDataStream(outputFileStream, blockIndicesForDirectory, blockSize);
+		MsfBlockStreamWriter streamSizesStream = directoryDataStream.GetSubStreamAtOffset(sizeof(uint32_t), numStreams * sizeof(uint32_t));
+		MsfBlockStreamWriter blockIndicesStream = directoryDataStream.GetSubStreamAtOffset(sizeof(uint32_t) + numStreams * sizeof(uint32_t));
 
 		size_t directorySizeInBytes = sizeof(uint32_t);
 		directoryDataStream.Write(numStreams);
@@ -427,7 +615,7 @@ namespace Decompression
 
 	bool RunDecompression(const ProgramCommandLineArgs& args)
 	{
-		SimpleWinFile msfzFile(args.m_InputFilePath.c_str());
+		SimpleFile msfzFile(args.m_InputFilePath.c_str());
 		{
 			LogScoped("Opening input file");
 			if (!msfzFile.Open(false))
@@ -497,7 +685,7 @@ namespace Decompression
 
 			// open output file for writing
 			const size_t totalSizeOfOutputFile = numBlocksTotal * blockSize;
-			SimpleWinFile outputFile(args.m_OutputFilePath.c_str());
+			SimpleFile outputFile(args.m_OutputFilePath.c_str());
 			{
 				if (!outputFile.Open(true))
 				{
@@ -527,7 +715,7 @@ namespace Decompression
 				outputSuperblock.m_BlockCount = StrictCastTo<uint32_t>(numBlocksTotal);
 
 				// directory block indices
-				MutableStreamFixedWithHoles directoryIndicesDataStream = GetStreamFromBlockIndices(outputFileStream, blockIndicesForDirectoryIndices, blockSize);
+				MsfBlockStreamWriter directoryIndicesDataStream(outputFileStream, blockIndicesForDirectoryIndices, blockSize);
 				directoryIndicesDataStream.WriteSpan<uint32_t>(blockIndicesForDirectory);
 
 				// superblock
@@ -561,7 +749,7 @@ namespace Decompression
 					}
 				}
 
-				MutableStreamFixedWithHoles freeBlockMapDataStream = GetStreamFromBlockIndices(outputFileStream, blockIndicesForFPM, blockSize);
+				MsfBlockStreamWriter freeBlockMapDataStream(outputFileStream, blockIndicesForFPM, blockSize);
 				freeBlockMapDataStream.WriteSpan<uint8_t>(freeBlockMapBitset.GetSpan());
 			}
 
@@ -573,4 +761,78 @@ namespace Decompression
 
 		return true;
 	}
+	void ReadFileLayout(const char* msfzFilePath, MsfzFileLayout& outLayout)
+	{
+		SimpleFile msfzFile(msfzFilePath);
+		if (!msfzFile.Open(false))
+		{
+			ThrowError("Unable to open %s.", msfzFilePath);
+		}
+
+		ImmutableStream fileStream(msfzFile.GetData(), msfzFile.GetSize());
+		const MsfzHeader* header = fileStream.Read<MsfzHeader>();
+		if (header == nullptr || memcmp(header->m_Signature, g_MsfzSignatureBytes, sizeof(g_MsfzSignatureBytes)) != 0)
+		{
+			ThrowError("Signature mismatch. Expected MSFZ signature at the beginning of %s.", msfzFilePath);
+		}
+		outLayout.m_Header = *header;
+
+		ReadOnlyVector<uint8_t> streamDirectoryData;
+		GetStreamDirectoryData(fileStream, header, streamDirectoryData);
+		outLayout.m_Streams.clear();
+		ParseStreamDirectoryData(streamDirectoryData, outLayout.m_Streams);
+
+		ReadOnlyVector<MsfzChunk> chunkDescriptors;
+		GetChunkDescriptorsData(fileStream, header, chunkDescriptors);
+		const std::span<const MsfzChunk> chunkDescriptorsSpan = chunkDescriptors;
+		outLayout.m_Chunks.assign(chunkDescriptorsSpan.begin(), chunkDescriptorsSpan.end());
+	}
+
+	void ReadStreamData(const char* msfzFilePath, const MsfzFileLayout& layout, const uint32_t streamIndex, std::vector<uint8_t>& outData)
+	{
+		SimpleFile msfzFile(msfzFilePath);
+		if (!msfzFile.Open(false))
+		{
+			ThrowError("Unable to open %s.", msfzFilePath);
+		}
+
+		ImmutableStream fileStream(msfzFile.GetData(), msfzFile.GetSize());
+		outData.clear();
+		// streams stored outside of chunks never need a decompression context
+		std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> decompressionContext(nullptr, &ZSTD_freeDCtx);
+		std::vector<uint8_t> chunkData;
+		for (const MsfzFragment& fragmentDesc : layout.m_Streams.at(streamIndex).m_Fragments)
+		{
+			uint64_t dataOffsetInFile = fragmentDesc.m_DataOffset;
+			const uint8_t* fragmentData = nullptr;
+			if (fragmentDesc.IsLocatedInChunk())
+			{
+				const MsfzChunk& chunkDesc = layout.m_Chunks.at(fragmentDesc.GetChunkIndex());
+				if (!fileStream.CanRead(chunkDesc.m_OffsetToChunkData, chunkDesc.m_CompressedSize) || fragmentDesc.m_DataOffset + static_cast<uint64_t>(fragmentDesc.m_DataSize) > chunkDesc.m_DecompressedSize)
+				{
+					ThrowError("Invalid data. Fragment goes out of bounds of its corresponding chunk.");
+				}
+				if (chunkDesc.m_IsCompressed)
+				{
+					if (!decompressionContext)
+					{
+						decompressionContext.reset(ZSTD_createDCtx());
+					}
+					chunkData.resize(chunkDesc.m_DecompressedSize);
+					DecompressChunkIntoBuffer(decompressionContext.get(), { fileStream.PeekAtOffset<uint8_t>(chunkDesc.m_OffsetToChunkData), chunkDesc.m_CompressedSize }, chunkDesc.m_DecompressedSize, chunkData.data());
+					fragmentData = chunkData.data() + fragmentDesc.m_DataOffset;
+				}
+				dataOffsetInFile += chunkDesc.m_OffsetToChunkData;
+			}
+			if (fragmentData == nullptr)
+			{
+				if (!fileStream.CanRead(dataOffsetInFile, fragmentDesc.m_DataSize))
+				{
+					ThrowError("Invalid data. Fragment is located outside of bounds of the file.");
+				}
+				fragmentData = fileStream.PeekAtOffset<uint8_t>(dataOffsetInFile);
+			}
+			outData.insert(outData.end(), fragmentData, fragmentData + fragmentDesc.m_DataSize);
+		}
+	}
 }
\ No newline at end of file
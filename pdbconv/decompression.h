@@ -1,7 +1,15 @@
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
 struct ProgramCommandLineArgs;
+struct MsfzFileLayout;
 namespace Decompression
 {
 	bool RunDecompression(const ProgramCommandLineArgs& args);
-}
+
+	// reading a MSFZ file piece by piece, the tests use these to check how the output of the compression is laid out and the benchmarks to time stream reads
+	void ReadFileLayout(const char* msfzFilePath, MsfzFileLayout& outLayout);
+	void ReadStreamData(const char* msfzFilePath, const MsfzFileLayout& layout, uint32_t streamIndex, std::vector<uint8_t>& outData);
+}
\ No newline at end of file
@@ -34,7 +34,8 @@ enum UsageMode : uint8_t
 {
 	Compress = 0,
 	Decompress = 1,
-	Batch = 2
+	Batch = 2,
+	Benchmark = 3
 };
 
 enum CompressionStrategy : uint8_t
@@ -44,6 +45,52 @@ enum CompressionStrategy : uint8_t
 	MultiFragment
 };
 
+// what a stream holds, based on where it's referenced from in the PDB
+enum StreamRole : uint8_t
+{
+	UnknownStream,
+	OldDirectoryStream,
+	PdbInfoStream,
+	TpiStream,
+	DbiStream,
+	IpiStream,
+	TpiHashStream,
+	IpiHashStream,
+	GlobalsStream,
+	PublicsStream,
+	SymbolRecordsStream,
+	ModuleSymbolsStream,
+	NamesStream,
+	NamedStream,
+	DebugDataStream,
+	NumStreamRoles
+};
+
+constexpr const char* g_StreamRoleNames[NumStreamRoles] =
+{
+	"Unknown",
+	"OldDirectory",
+	"PdbInfo",
+	"Tpi",
+	"Dbi",
+	"Ipi",
+	"TpiHash",
+	"IpiHash",
+	"Globals",
+	"Publics",
+	"SymbolRecords",
+	"ModuleSymbols",
+	"Names",
+	"Named",
+	"DebugData"
+};
+
+enum ChunkLayout : uint8_t
+{
+	StreamOrder,
+	LoadOrder
+};
+
 struct ProgramCommandLineArgs
 {
 	std::string m_InputFilePath;
@@ -55,6 +102,15 @@ struct ProgramCommandLineArgs
 	std::optional<uint32_t> m_CompressionLevel;
 	std::optional<uint32_t> m_FixedFragmentSize;
 	std::optional<uint32_t> m_MaxFragmentsPerStream;
+	bool m_AlignFragmentsToRecords = false;
+	std::optional<uint32_t> m_InputMemoryLimitMB;
+	std::optional<uint32_t> m_PackedChunkSize;
+	std::optional<uint32_t> m_MaxRawStreamSize;
+	std::optional<uint32_t> m_RawChunkThreshold;
+	std::optional<uint32_t> m_RawChunkAlignment;
+	std::optional<ChunkLayout> m_ChunkLayout;
+	std::optional<std::string> m_CompressionPolicy;	// name of a built-in policy preset or path to a policy file
+	bool m_PrintStats = false;
 
 	// decompression args
 	std::optional<uint32_t> m_BlockSize;
@@ -71,6 +127,92 @@ struct PDBSuperBlock
 	uint32_t m_Unknown1_32t;
 };
 
+// fixed MSF stream indices
+constexpr uint32_t g_PdbInfoStreamIndex = 1u;
+constexpr uint32_t g_TpiStreamIndex = 2u;
+constexpr uint32_t g_DbiStreamIndex = 3u;
+constexpr uint32_t g_IpiStreamIndex = 4u;
+
+// stream indices in the headers below are 16 bit, this one means there's no such stream
+constexpr uint16_t g_InvalidStreamIndex = 0xFFFF;
+
+// header of the TPI and IPI streams
+struct PDBTypeStreamHeader
+{
+	uint32_t m_Version;
+	uint32_t m_HeaderSize;
+	uint32_t m_TypeIndexBegin;
+	uint32_t m_TypeIndexEnd;
+	uint32_t m_TypeRecordBytes;
+	uint16_t m_HashStreamIndex;
+	uint16_t m_HashAuxStreamIndex;
+	uint32_t m_HashKeySize;
+	uint32_t m_NumHashBuckets;
+	int32_t m_HashValueBufferOffset;
+	uint32_t m_HashValueBufferLength;
+	int32_t m_IndexOffsetBufferOffset;
+	uint32_t m_IndexOffsetBufferLength;
+	int32_t m_HashAdjBufferOffset;
+	uint32_t m_HashAdjBufferLength;
+};
+static_assert(sizeof(PDBTypeStreamHeader) == 56);
+
+// header of the DBI stream
+struct PDBDbiStreamHeader
+{
+	int32_t m_VersionSignature;
+	uint32_t m_VersionHeader;
+	uint32_t m_Age;
+	uint16_t m_GlobalStreamIndex;
+	uint16_t m_BuildNumber;
+	uint16_t m_PublicStreamIndex;
+	uint16_t m_PdbDllVersion;
+	uint16_t m_SymRecordStreamIndex;
+	uint16_t m_PdbDllRbld;
+	int32_t m_ModInfoSize;
+	int32_t m_SectionContributionSize;
+	int32_t m_SectionMapSize;
+	int32_t m_SourceInfoSize;
+	int32_t m_TypeServerMapSize;
+	uint32_t m_MFCTypeServerIndex;
+	int32_t m_OptionalDbgHeaderSize;
+	int32_t m_ECSubstreamSize;
+	uint16_t m_Flags;
+	uint16_t m_Machine;
+	uint32_t m_Padding;
+};
+static_assert(sizeof(PDBDbiStreamHeader) == 64);
+
+// fixed part of a module info record in the DBI stream, followed by the null terminated module and object file names, padded to 4 bytes
+struct PDBModuleInfo
+{
+	uint32_t m_Unused1;
+	uint8_t m_SectionContribution[28];
+	uint16_t m_Flags;
+	uint16_t m_ModuleSymStreamIndex;
+	uint32_t m_SymByteSize;
+	uint32_t m_C11ByteSize;
+	uint32_t m_C13ByteSize;
+	uint16_t m_SourceFileCount;
+	uint16_t m_Padding;
+	uint32_t m_Unused2;
+	uint32_t m_SourceFileNameIndex;
+	uint32_t m_PdbFilePathNameIndex;
+};
+static_assert(sizeof(PDBModuleInfo) == 64);
+
+// header of the section map substream in the DBI stream, followed by m_Count entries
+struct PDBSectionMapHeader
+{
+	uint16_t m_Count;
+	uint16_t m_LogCount;
+};
+
+constexpr uint32_t g_SectionMapEntrySize = 20u;
+
+// the optional debug header in the DBI stream is an array of stream indices, one per kind of debug data (FPO, OMAP, section headers, ...)
+constexpr uint32_t g_MaxNumDbiDebugStreams = 11u;
+
 struct MsfzHeader
 {
 	uint8_t m_Signature[0x20];
@@ -119,4 +261,12 @@ struct MsfzStream
 		}
 		return ynw::StrictCastTo<uint32_t>(sizeValue);
 	}
-};
\ No newline at end of file
+};
+
+// the metadata of a MSFZ file, i.e. everything but the stream data itself
+struct MsfzFileLayout
+{
+	MsfzHeader m_Header = {};
+	std::vector<MsfzChunk> m_Chunks;
+	std::vector<MsfzStream> m_Streams;
+};
@@ -10,6 +10,7 @@
 #include "compression.h"
 #include "decompression.h"
 #include "test.h"
+#include "benchmark.h"
 
 #include <vector>
 #include <fstream>
@@ -19,7 +20,9 @@
 #include <map>
 #include <cassert>
 
+#ifdef _MSC_VER
 #pragma comment(lib, ZSTDLIB_PATH)
+#endif
 
 using namespace ynw;
 
@@ -32,14 +35,15 @@ static void RegisterCommandLineOptions()
 
 	CommandLineOption* outputPathOption = CommandLineOption::Register<StringValueCommandLineOption>('o', "output", " | Path to the output file when using --compress or --decompress or the output directory when using --test.");
 	outputPathOption->SetRequired(true);
+	outputPathOption->SetExcludedOptions("k");
 
 	CommandLineOption* decompressOption = CommandLineOption::Register<CommandLineOption>('x', "decompress", " | Decompress input file in the MSFZ format to a regular PDB output file.");
 	decompressOption->SetRequired(true);
-	decompressOption->SetExcludedOptions("ct");
+	decompressOption->SetExcludedOptions("ctk");
 
 	CommandLineOption* compressOption = CommandLineOption::Register<CommandLineOption>('c', "compress", " | Compress input PDB file to a MSFZ format output file.");
 	compressOption->SetRequired(true);
-	compressOption->SetExcludedOptions("xt");
+	compressOption->SetExcludedOptions("xtk");
 
 	StringValueCommandLineOption* strategyOption = CommandLineOption::Register<StringValueCommandLineOption>('s', "strategy", " (NoCompression, SingleFragment, MultiFragment) | Compression strategy to use when using --compress.");
 	strategyOption->SetRequired(true);
@@ -85,6 +89,70 @@ static void RegisterCommandLineOptions()
 			return false;
 		});
 
+	CommandLineOption* alignToRecordsOption = CommandLineOption::Register<CommandLineOption>("align_to_records", " | Cut fragments of the TPI, IPI and module symbol streams only between records, as close to the fragment size as possible, when using --compress and --strategy=MultiFragment.");
+	alignToRecordsOption->SetRequiredOptions("c");
+	alignToRecordsOption->SetCustomValidationCallback([](const CommandLineOption* /*alignToRecordsOption*/) -> bool
+		{
+			if (StringValueCommandLineOption* strategyOption = static_cast<StringValueCommandLineOption*>(CommandLineOption::GetOption('s')))
+			{
+				if (strategyOption->GetValue() == "MultiFragment")
+				{
+					return true;
+				}
+			}
+			ThrowArgsError("Aligning fragments to records can only be used when compression strategy is set to MultiFragment");
+			return false;
+		});
+
+	IntegerValueCommandLineOption* inputMemoryLimitOption = CommandLineOption::Register<IntegerValueCommandLineOption>("input_memory_limit", " (default 0) | Memory limit in MB for reading the input file when using --compress. The input is read on demand instead of being mapped as a whole when the limit is not 0.");
+	inputMemoryLimitOption->SetRequiredOptions("c");
+	inputMemoryLimitOption->SetDefaultValue(0);
+
+	IntegerValueCommandLineOption* packedChunkSizeOption = CommandLineOption::Register<IntegerValueCommandLineOption>("pack_chunk_size", " (0-16777216, default 0) | Pack streams that fit in a single fragment smaller than this many bytes into shared chunks of up to this size when using --compress. 0 keeps one chunk per fragment.");
+	packedChunkSizeOption->SetRequiredOptions("c");
+	packedChunkSizeOption->SetMinValue(0);
+	packedChunkSizeOption->SetMaxValue(16 << 20);
+	packedChunkSizeOption->SetDefaultValue(0);
+
+	IntegerValueCommandLineOption* maxRawStreamSizeOption = CommandLineOption::Register<IntegerValueCommandLineOption>("raw_stream_size", " (0-65536, default 0) | Store streams of at most this many bytes uncompressed and outside of any chunk, right after the chunk metadata, when using --compress. 0 keeps every stream in chunks.");
+	maxRawStreamSizeOption->SetRequiredOptions("c");
+	maxRawStreamSizeOption->SetMinValue(0);
+	maxRawStreamSizeOption->SetMaxValue(0x10000);
+	maxRawStreamSizeOption->SetDefaultValue(0);
+
+	IntegerValueCommandLineOption* rawChunkThresholdOption = CommandLineOption::Register<IntegerValueCommandLineOption>("raw_chunk_threshold", " (1-100, default 97) | Store chunks uncompressed when zstd can't shrink them below this percentage of their size when using --compress. 100 keeps every chunk that gets smaller at all compressed.");
+	rawChunkThresholdOption->SetRequiredOptions("c");
+	rawChunkThresholdOption->SetMinValue(1);
+	rawChunkThresholdOption->SetMaxValue(100);
+	rawChunkThresholdOption->SetDefaultValue(97);
+
+	IntegerValueCommandLineOption* rawChunkAlignmentOption = CommandLineOption::Register<IntegerValueCommandLineOption>("raw_chunk_alignment", " (0, 4096 or 65536, default 0) | Start uncompressed chunks of at least this many bytes at offsets aligned to it when using --compress, so readers can map them without copying. 0 keeps chunks back to back.");
+	rawChunkAlignmentOption->SetRequiredOptions("c");
+	rawChunkAlignmentOption->SetDefaultValue(0);
+	rawChunkAlignmentOption->SetCustomValidationCallback([](const CommandLineOption* /*rawChunkAlignmentOption*/) -> bool
+		{
+			const std::vector<uint32_t> k_AcceptedRawChunkAlignmentValues = { 0, 0x1000, 0x10000 };
+			if (IntegerValueCommandLineOption* rawChunkAlignmentOption = static_cast<IntegerValueCommandLineOption*>(CommandLineOption::GetOption("raw_chunk_alignment")))
+			{
+				if (std::find(k_AcceptedRawChunkAlignmentValues.begin(), k_AcceptedRawChunkAlignmentValues.end(), rawChunkAlignmentOption->GetValue()) != k_AcceptedRawChunkAlignmentValues.end())
+				{
+					return true;
+				}
+			}
+			ThrowArgsError("Raw chunk alignment must be one of { 0, 0x1000, 0x10000 }");
+			return false;
+		});
+
+	StringValueCommandLineOption* layoutOption = CommandLineOption::Register<StringValueCommandLineOption>("layout", " (StreamOrder, LoadOrder, default StreamOrder) | Order of the chunks in the output file when using --compress. LoadOrder puts the data that debuggers read when opening the PDB at the front of the file.");
+	layoutOption->SetRequiredOptions("c");
+	layoutOption->SetAcceptedValues({ "StreamOrder", "LoadOrder" });
+
+	StringValueCommandLineOption* policyOption = CommandLineOption::Register<StringValueCommandLineOption>("policy", " (fast-load, archive or a path to a policy file) | Per stream compression settings by stream role, stream index or stream size, applied on top of the other compression options when using --compress.");
+	policyOption->SetRequiredOptions("c");
+
+	CommandLineOption* statsOption = CommandLineOption::Register<CommandLineOption>("stats", " | Print a report of the input and output sizes by stream role (TPI, DBI, module symbols, ...) when using --compress.");
+	statsOption->SetRequiredOptions("c");
+
 	IntegerValueCommandLineOption* blockSizeOption = CommandLineOption::Register<IntegerValueCommandLineOption>('b', "block_size", " (default 4096) | Block size value to use for the output MSF streams when using --decompress.");
 	blockSizeOption->SetRequiredOptions("x");
 	blockSizeOption->SetDefaultValue(0x1000);
@@ -103,10 +171,15 @@ static void RegisterCommandLineOptions()
 		});
 
 	CommandLineOption::Register<IntegerValueCommandLineOption>("thread_num", "(default 75% of processor count) | Number of threads to use for compression or decompression workflows.");
+	CommandLineOption::Register<CommandLineOption>("numa_pin", " | Pin worker threads to NUMA nodes, spreading them evenly over the nodes.");
 
 	CommandLineOption* testModeCommandLineOption = CommandLineOption::Register<CommandLineOption>('t', "test", " | Run test batch conversion on directory.");
 	testModeCommandLineOption->SetRequired(true);
-	testModeCommandLineOption->SetExcludedOptions("xc");
+	testModeCommandLineOption->SetExcludedOptions("xck");
+
+	CommandLineOption* benchmarkModeCommandLineOption = CommandLineOption::Register<CommandLineOption>('k', "benchmark", " | Run compression & decompression benchmarks on the input file.");
+	benchmarkModeCommandLineOption->SetRequired(true);
+	benchmarkModeCommandLineOption->SetExcludedOptions("xct");
 }
 
 bool ParseCommandLineOptions(const int argc, const char** argv, ProgramCommandLineArgs& outArgs)
@@ -128,6 +201,7 @@ bool ParseCommandLineOptions(const int argc, const char** argv, ProgramCommandLi
 
 	const CommandLineOption* compressionOption = CommandLineOption::GetOption('c');
 	const CommandLineOption* decompressionOption = CommandLineOption::GetOption('x');
+	const CommandLineOption* benchmarkOption = CommandLineOption::GetOption('k');
 	if (compressionOption->IsPresent())
 	{
 		outArgs.m_UsageMode = UsageMode::Compress;
@@ -135,7 +209,7 @@ bool ParseCommandLineOptions(const int argc, const char** argv, ProgramCommandLi
 		const StringValueCommandLineOption* strategyOption = CommandLineOption::GetOption<StringValueCommandLineOption>('s');
 		assert(strategyOption->IsPresent());
 		const std::string& strategy = strategyOption->GetValue();
-		if (strategy == "None")
+		if (strategy == "NoCompression")
 		{
 			outArgs.m_CompressionStrategy = CompressionStrategy::NoCompression;
 		}
@@ -152,6 +226,8 @@ bool ParseCommandLineOptions(const int argc, const char** argv, ProgramCommandLi
 
 			const IntegerValueCommandLineOption* maxFragmentsPerStreamOption = CommandLineOption::GetOption<IntegerValueCommandLineOption>('m');
 			outArgs.m_MaxFragmentsPerStream = StrictCastTo<uint32_t>(maxFragmentsPerStreamOption->GetValue());
+
+			outArgs.m_AlignFragmentsToRecords = CommandLineOption::GetOption("align_to_records")->IsPresent();
 		}
 		else
 		{
@@ -160,6 +236,32 @@ bool ParseCommandLineOptions(const int argc, const char** argv, ProgramCommandLi
 
 		const IntegerValueCommandLineOption* levelOption = CommandLineOption::GetOption<IntegerValueCommandLineOption>('l');
 		outArgs.m_CompressionLevel = StrictCastTo<uint32_t>(levelOption->GetValue());
+
+		const IntegerValueCommandLineOption* inputMemoryLimitOption = CommandLineOption::GetOption<IntegerValueCommandLineOption>("input_memory_limit");
+		outArgs.m_InputMemoryLimitMB = StrictCastTo<uint32_t>(inputMemoryLimitOption->GetValue());
+
+		const IntegerValueCommandLineOption* packedChunkSizeOption = CommandLineOption::GetOption<IntegerValueCommandLineOption>("pack_chunk_size");
+		outArgs.m_PackedChunkSize = StrictCastTo<uint32_t>(packedChunkSizeOption->GetValue());
+
+		const IntegerValueCommandLineOption* maxRawStreamSizeOption = CommandLineOption::GetOption<IntegerValueCommandLineOption>("raw_stream_size");
+		outArgs.m_MaxRawStreamSize = StrictCastTo<uint32_t>(maxRawStreamSizeOption->GetValue());
+
+		const IntegerValueCommandLineOption* rawChunkThresholdOption = CommandLineOption::GetOption<IntegerValueCommandLineOption>("raw_chunk_threshold");
+		outArgs.m_RawChunkThreshold = StrictCastTo<uint32_t>(rawChunkThresholdOption->GetValue());
+
+		const IntegerValueCommandLineOption* rawChunkAlignmentOption = CommandLineOption::GetOption<IntegerValueCommandLineOption>("raw_chunk_alignment");
+		outArgs.m_RawChunkAlignment = StrictCastTo<uint32_t>(rawChunkAlignmentOption->GetValue());
+
+		const StringValueCommandLineOption* layoutOption = CommandLineOption::GetOption<StringValueCommandLineOption>("layout");
+		outArgs.m_ChunkLayout = layoutOption->IsPresent() && layoutOption->GetValue() == "LoadOrder" ? ChunkLayout::LoadOrder : ChunkLayout::StreamOrder;
+
+		const StringValueCommandLineOption* policyOption = CommandLineOption::GetOption<StringValueCommandLineOption>("policy");
+		if (policyOption->IsPresent())
+		{
+			outArgs.m_CompressionPolicy = policyOption->GetValue();
+		}
+
+		outArgs.m_PrintStats = CommandLineOption::GetOption("stats")->IsPresent();
 }
 	else if (decompressionOption->IsPresent())
 	{
@@ -168,6 +270,10 @@ bool ParseCommandLineOptions(const int argc, const char** argv, ProgramCommandLi
 		const IntegerValueCommandLineOption* strategyOption = CommandLineOption::GetOption<IntegerValueCommandLineOption>('b');
 		outArgs.m_BlockSize = StrictCastTo<uint32_t>(strategyOption->GetValue());
 	}
+	else if (benchmarkOption->IsPresent())
+	{
+		outArgs.m_UsageMode = UsageMode::Benchmark;
+	}
 	else
 	{
 		outArgs.m_UsageMode = UsageMode::Batch;
@@ -178,6 +284,7 @@ bool ParseCommandLineOptions(const int argc, const char** argv, ProgramCommandLi
 	{
 		ThreadConfig::SetDefaultNumThreads(StrictCastTo<uint32_t>(threadNumOption->GetValue()));
 	}
+	ThreadConfig::SetPinWorkersToNumaNodes(CommandLineOption::GetOption("numa_pin")->IsPresent());
 
 	return true;
 }
@@ -201,6 +308,10 @@ int main(const int argc, const char** argv)
 	{
 		Decompression::RunDecompression(programArgs);
 	}
+	else if (programArgs.m_UsageMode == UsageMode::Benchmark)
+	{
+		Benchmarking::RunBenchmark(programArgs);
+	}
 	else
 	{
 		IsTestMode() = true;
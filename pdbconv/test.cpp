@@ -3,12 +3,16 @@
 #include "decompression.h"
 #include "y_thread.h"
 
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
 
 namespace Testing
 {
 	// Update manually if it changes, too lazy to have a generic solution...
-	constexpr uint32_t k_NumTests = 121;
+	constexpr uint32_t k_NumTests = 286;
 	ynw::LogProgressTracker* g_CurrentProgressTracker;
 	std::string g_OutputFolderPath;
 
@@ -24,7 +28,7 @@ namespace Testing
 			std::string name = std::filesystem::path(args.m_InputFilePath).filename().replace_extension().string();
 			name += "_b{" + std::to_string(args.m_BlockSize.value()) + "}";
 			name += "_converted.pdb";
-			return g_OutputFolderPath + "\\" + name;
+			return (std::filesystem::path(g_OutputFolderPath) / name).string();
 		}
 
 		void TestWithArgs(ProgramCommandLineArgs args)
@@ -78,13 +82,46 @@ namespace Testing
 			{
 				name += "_f{" + std::to_string(args.m_FixedFragmentSize.value()) + "}";
 				name += "_m{" + std::to_string(args.m_MaxFragmentsPerStream.value()) + "}";
+				if (args.m_AlignFragmentsToRecords)
+				{
+					name += "_a";
+				}
 			}
 			name += "_l{" + std::to_string(args.m_CompressionLevel.value()) + "}";
+			if (args.m_InputMemoryLimitMB.value_or(0u) != 0)
+			{
+				name += "_r{" + std::to_string(args.m_InputMemoryLimitMB.value()) + "}";
+			}
+			if (args.m_PackedChunkSize.value_or(0u) != 0)
+			{
+				name += "_P{" + std::to_string(args.m_PackedChunkSize.value()) + "}";
+			}
+			if (args.m_MaxRawStreamSize.value_or(0u) != 0)
+			{
+				name += "_R{" + std::to_string(args.m_MaxRawStreamSize.value()) + "}";
+			}
+			if (args.m_RawChunkThreshold.has_value())
+			{
+				name += "_T{" + std::to_string(args.m_RawChunkThreshold.value()) + "}";
+			}
+			if (args.m_RawChunkAlignment.value_or(0u) != 0)
+			{
+				name += "_A{" + std::to_string(args.m_RawChunkAlignment.value()) + "}";
+			}
+			if (args.m_ChunkLayout.value_or(ChunkLayout::StreamOrder) != ChunkLayout::StreamOrder)
+			{
+				name += "_L{" + std::to_string(static_cast<uint8_t>(args.m_ChunkLayout.value())) + "}";
+			}
+			if (args.m_CompressionPolicy.has_value())
+			{
+				name += "_p{" + std::filesystem::path(args.m_CompressionPolicy.value()).stem().string() + "}";
+			}
 			name += "_msfz.pdb";
-			return g_OutputFolderPath + "\\" + name;
+			return (std::filesystem::path(g_OutputFolderPath) / name).string();
 		}
 
-		void TestWithArgs(ProgramCommandLineArgs args)
+		// returns the path of the compressed file, for the tests that check how it's laid out
+		std::string TestWithArgs(ProgramCommandLineArgs args)
 		{
 			args.m_OutputFilePath = GetOutputFileName(args);
 			g_CurrentProgressTracker->UpdateProgress(1);
@@ -95,6 +132,22 @@ namespace Testing
 
 			// re-decompress and test
 			MSFZ2PDB::TestAll(args.m_OutputFilePath.c_str());
+			return args.m_OutputFilePath;
+		}
+
+		// what the tests of a single option start from, 4KB fragments with MultiFragment
+		ProgramCommandLineArgs GetBaseArgs(const char* inputPath, const CompressionStrategy strategy)
+		{
+			ProgramCommandLineArgs args = {};
+			args.m_InputFilePath = inputPath;
+			args.m_CompressionStrategy = strategy;
+			args.m_CompressionLevel = 3;
+			if (strategy == CompressionStrategy::MultiFragment)
+			{
+				args.m_FixedFragmentSize = 0x1000;
+				args.m_MaxFragmentsPerStream = 0x100;
+			}
+			return args;
 		}
 
 		void TestDefaultArgsSelectedStrategy(const char* inputPath, CompressionStrategy strategy)
@@ -129,10 +182,374 @@ namespace Testing
 			}
 		}
 
+		void TestStreamedInput(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = {};
+			args.m_InputFilePath = inputPath;
+			args.m_CompressionLevel = 3;
+			args.m_InputMemoryLimitMB = 1;
+			args.m_CompressionStrategy = CompressionStrategy::SingleFragment;
+			TestWithArgs(args);
+
+			args.m_CompressionStrategy = CompressionStrategy::MultiFragment;
+			args.m_FixedFragmentSize = 0x1000;
+			args.m_MaxFragmentsPerStream = 0x100;
+			TestWithArgs(args);
+		}
+
+		void TestRecordAlignedFragments(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::MultiFragment);
+			args.m_FixedFragmentSize = 0x100;
+			args.m_MaxFragmentsPerStream = 0x3001;
+			args.m_AlignFragmentsToRecords = true;
+			const std::string outputPath = TestWithArgs(args);
+
+			// every fragment that ends within the type records of the TPI or IPI stream has to end where a record does
+			MsfzFileLayout layout;
+			Decompression::ReadFileLayout(outputPath.c_str(), layout);
+			for (const uint32_t streamIndex : { g_TpiStreamIndex, g_IpiStreamIndex })
+			{
+				if (streamIndex >= layout.m_Streams.size())
+				{
+					continue;
+				}
+				std::vector<uint8_t> streamData;
+				Decompression::ReadStreamData(outputPath.c_str(), layout, streamIndex, streamData);
+				if (streamData.size() < sizeof(PDBTypeStreamHeader))
+				{
+					continue;
+				}
+
+				PDBTypeStreamHeader typeStreamHeader = {};
+				memcpy(&typeStreamHeader, streamData.data(), sizeof(PDBTypeStreamHeader));
+				const uint64_t recordsBeginOffset = typeStreamHeader.m_HeaderSize;
+				const uint64_t recordsEndOffset = std::min<uint64_t>(recordsBeginOffset + typeStreamHeader.m_TypeRecordBytes, streamData.size());
+				std::vector<uint64_t> recordOffsets;
+				for (uint64_t recordOffset = recordsBeginOffset; recordOffset + sizeof(uint16_t) <= recordsEndOffset;)
+				{
+					recordOffsets.push_back(recordOffset);
+					uint16_t recordLength = 0;
+					memcpy(&recordLength, streamData.data() + recordOffset, sizeof(uint16_t));
+					recordOffset += sizeof(uint16_t) + recordLength;
+				}
+
+				uint64_t fragmentEndOffset = 0;
+				for (const MsfzFragment& fragmentDesc : layout.m_Streams[streamIndex].m_Fragments)
+				{
+					fragmentEndOffset += fragmentDesc.m_DataSize;
+					if (fragmentEndOffset > recordsBeginOffset && fragmentEndOffset < recordsEndOffset && !std::binary_search(recordOffsets.begin(), recordOffsets.end(), fragmentEndOffset))
+					{
+						ynw::ThrowError("%s: a fragment of stream %u ends at offset %llu, within a type record.", outputPath.c_str(), streamIndex, fragmentEndOffset);
+					}
+				}
+			}
+		}
+
+		void TestLoadOrderLayout(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::MultiFragment);
+			args.m_ChunkLayout = ChunkLayout::LoadOrder;
+			const std::string outputPath = TestWithArgs(args);
+
+			MsfzFileLayout layout;
+			Decompression::ReadFileLayout(outputPath.c_str(), layout);
+			for (const MsfzChunk& chunkDesc : layout.m_Chunks)
+			{
+				if (chunkDesc.m_OffsetToChunkData < layout.m_Header.m_StreamDirectoryDataOffset)
+				{
+					ynw::ThrowError("%s: the stream directory at offset %u doesn't come before the chunk data at offset %u.", outputPath.c_str(), layout.m_Header.m_StreamDirectoryDataOffset, chunkDesc.m_OffsetToChunkData);
+				}
+			}
+
+			// the whole DBI stream is read when the PDB is opened, while the TPI and IPI streams are only read past their first fragment on demand
+			const auto getChunkOffset = [&layout](const MsfzFragment& fragmentDesc)
+				{
+					return fragmentDesc.IsLocatedInChunk() ? layout.m_Chunks.at(fragmentDesc.GetChunkIndex()).m_OffsetToChunkData : fragmentDesc.m_DataOffset;
+				};
+			uint32_t firstTypeRecordsOffset = UINT32_MAX;
+			for (const uint32_t streamIndex : { g_TpiStreamIndex, g_IpiStreamIndex })
+			{
+				for (size_t fragmentIndex = 1; streamIndex < layout.m_Streams.size() && fragmentIndex < layout.m_Streams[streamIndex].m_Fragments.size(); ++fragmentIndex)
+				{
+					firstTypeRecordsOffset = std::min(firstTypeRecordsOffset, getChunkOffset(layout.m_Streams[streamIndex].m_Fragments[fragmentIndex]));
+				}
+			}
+			if (g_DbiStreamIndex < layout.m_Streams.size())
+			{
+				for (const MsfzFragment& fragmentDesc : layout.m_Streams[g_DbiStreamIndex].m_Fragments)
+				{
+					if (getChunkOffset(fragmentDesc) > firstTypeRecordsOffset)
+					{
+						ynw::ThrowError("%s: DBI stream data at offset %u comes after the TPI/IPI type records at offset %u.", outputPath.c_str(), getChunkOffset(fragmentDesc), firstTypeRecordsOffset);
+					}
+				}
+			}
+		}
+
+		void TestPackedChunks(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::SingleFragment);
+			args.m_PackedChunkSize = 0x10000;
+			const std::string outputPath = TestWithArgs(args);
+
+			MsfzFileLayout layout;
+			Decompression::ReadFileLayout(outputPath.c_str(), layout);
+			std::vector<uint32_t> numFragmentsInChunks(layout.m_Chunks.size());
+			for (const MsfzStream& streamDesc : layout.m_Streams)
+			{
+				for (const MsfzFragment& fragmentDesc : streamDesc.m_Fragments)
+				{
+					if (fragmentDesc.IsLocatedInChunk())
+					{
+						++numFragmentsInChunks.at(fragmentDesc.GetChunkIndex());
+					}
+				}
+			}
+
+			uint32_t numPackedChunks = 0;
+			for (uint32_t chunkIndex = 0; chunkIndex < layout.m_Chunks.size(); ++chunkIndex)
+			{
+				if (numFragmentsInChunks[chunkIndex] > 1)
+				{
+					++numPackedChunks;
+					if (layout.m_Chunks[chunkIndex].m_DecompressedSize > args.m_PackedChunkSize.value())
+					{
+						ynw::ThrowError("%s: packed chunk %u holds %u bytes, more than the %u bytes it's allowed to.", outputPath.c_str(), chunkIndex, layout.m_Chunks[chunkIndex].m_DecompressedSize, args.m_PackedChunkSize.value());
+					}
+				}
+			}
+			if (numPackedChunks == 0)
+			{
+				ynw::ThrowError("%s: no chunk holds more than one fragment.", outputPath.c_str());
+			}
+		}
+
+		void TestRawStreams(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::SingleFragment);
+			args.m_MaxRawStreamSize = 0x200;
+			const std::string outputPath = TestWithArgs(args);
+
+			// the tiny streams follow each other right after the chunk metadata, in stream order, and everything else comes after them
+			MsfzFileLayout layout;
+			Decompression::ReadFileLayout(outputPath.c_str(), layout);
+			uint64_t rawStreamDataEndOffset = static_cast<uint64_t>(layout.m_Header.m_ChunkMetadataOffset) + layout.m_Header.m_ChunkMetadataLength;
+			for (uint32_t streamIndex = 0; streamIndex < layout.m_Streams.size(); ++streamIndex)
+			{
+				const MsfzStream& streamDesc = layout.m_Streams[streamIndex];
+				const uint32_t streamSize = streamDesc.CalculateSize();
+				const bool isRawStream = streamSize != 0 && streamSize <= args.m_MaxRawStreamSize.value();
+				for (const MsfzFragment& fragmentDesc : streamDesc.m_Fragments)
+				{
+					if (fragmentDesc.IsLocatedInChunk() == isRawStream)
+					{
+						ynw::ThrowError("%s: stream %u has %u bytes, but %s in a chunk.", outputPath.c_str(), streamIndex, streamSize, isRawStream ? "is" : "isn't");
+					}
+					if (isRawStream)
+					{
+						if (fragmentDesc.m_DataOffset != rawStreamDataEndOffset)
+						{
+							ynw::ThrowError("%s: stream %u is at offset %u instead of %llu.", outputPath.c_str(), streamIndex, fragmentDesc.m_DataOffset, rawStreamDataEndOffset);
+						}
+						rawStreamDataEndOffset += fragmentDesc.m_DataSize;
+					}
+				}
+			}
+			for (const MsfzChunk& chunkDesc : layout.m_Chunks)
+			{
+				if (chunkDesc.m_OffsetToChunkData < rawStreamDataEndOffset)
+				{
+					ynw::ThrowError("%s: chunk data at offset %u overlaps the raw stream data, which ends at offset %llu.", outputPath.c_str(), chunkDesc.m_OffsetToChunkData, rawStreamDataEndOffset);
+				}
+			}
+		}
+
+		// 1 stores nearly every chunk raw, 100 only the ones that zstd can't shrink at all
+		void TestRawChunkThresholds(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::MultiFragment);
+			for (const uint32_t rawChunkThreshold : { 1u, 100u })
+			{
+				args.m_RawChunkThreshold = rawChunkThreshold;
+				const std::string outputPath = TestWithArgs(args);
+
+				MsfzFileLayout layout;
+				Decompression::ReadFileLayout(outputPath.c_str(), layout);
+				for (uint32_t chunkIndex = 0; chunkIndex < layout.m_Chunks.size(); ++chunkIndex)
+				{
+					const MsfzChunk& chunkDesc = layout.m_Chunks[chunkIndex];
+					if (chunkDesc.m_IsCompressed && static_cast<uint64_t>(chunkDesc.m_CompressedSize) * 100u >= static_cast<uint64_t>(chunkDesc.m_DecompressedSize) * rawChunkThreshold)
+					{
+						ynw::ThrowError("%s: chunk %u is compressed from %u to %u bytes, which is over the %u%% threshold.", outputPath.c_str(), chunkIndex, chunkDesc.m_DecompressedSize, chunkDesc.m_CompressedSize, rawChunkThreshold);
+					}
+					if (!chunkDesc.m_IsCompressed && chunkDesc.m_CompressedSize != chunkDesc.m_DecompressedSize)
+					{
+						ynw::ThrowError("%s: raw chunk %u takes %u bytes for %u bytes of data.", outputPath.c_str(), chunkIndex, chunkDesc.m_CompressedSize, chunkDesc.m_DecompressedSize);
+					}
+				}
+			}
+		}
+
+		void TestAlignedRawChunks(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::MultiFragment);
+			args.m_RawChunkAlignment = 0x1000;
+			// with a threshold of 1, nearly every chunk is stored raw, so there's always something to align
+			for (const std::optional<uint32_t> rawChunkThreshold : { std::optional<uint32_t>(), std::optional<uint32_t>(1u) })
+			{
+				args.m_RawChunkThreshold = rawChunkThreshold;
+				const std::string outputPath = TestWithArgs(args);
+
+				MsfzFileLayout layout;
+				Decompression::ReadFileLayout(outputPath.c_str(), layout);
+				uint32_t numAlignedChunks = 0;
+				for (uint32_t chunkIndex = 0; chunkIndex < layout.m_Chunks.size(); ++chunkIndex)
+				{
+					const MsfzChunk& chunkDesc = layout.m_Chunks[chunkIndex];
+					if (!chunkDesc.m_IsCompressed && chunkDesc.m_CompressedSize >= args.m_RawChunkAlignment.value())
+					{
+						++numAlignedChunks;
+						if (chunkDesc.m_OffsetToChunkData % args.m_RawChunkAlignment.value() != 0)
+						{
+							ynw::ThrowError("%s: raw chunk %u is at offset %u, which isn't aligned to %u bytes.", outputPath.c_str(), chunkIndex, chunkDesc.m_OffsetToChunkData, args.m_RawChunkAlignment.value());
+						}
+					}
+				}
+				if (rawChunkThreshold.has_value() && numAlignedChunks == 0)
+				{
+					ynw::ThrowError("%s: no raw chunk is large enough to be aligned.", outputPath.c_str());
+				}
+
+				// the chunks that fill the padding mustn't overlap the aligned ones
+				std::vector<MsfzChunk> chunksByOffset = layout.m_Chunks;
+				std::sort(chunksByOffset.begin(), chunksByOffset.end(), [](const MsfzChunk& lhs, const MsfzChunk& rhs) { return lhs.m_OffsetToChunkData < rhs.m_OffsetToChunkData; });
+				for (size_t i = 1; i < chunksByOffset.size(); ++i)
+				{
+					if (static_cast<uint64_t>(chunksByOffset[i - 1].m_OffsetToChunkData) + chunksByOffset[i - 1].m_CompressedSize > chunksByOffset[i].m_OffsetToChunkData)
+					{
+						ynw::ThrowError("%s: the chunks at offsets %u and %u overlap.", outputPath.c_str(), chunksByOffset[i - 1].m_OffsetToChunkData, chunksByOffset[i].m_OffsetToChunkData);
+					}
+				}
+			}
+		}
+
+		void TestCompressionPolicies(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::SingleFragment);
+			for (const char* policy : { "fast-load", "archive" })
+			{
+				args.m_CompressionPolicy = policy;
+				const std::string outputPath = TestWithArgs(args);
+
+				MsfzFileLayout layout;
+				Decompression::ReadFileLayout(outputPath.c_str(), layout);
+				const bool isFastLoadPolicy = strcmp(policy, "fast-load") == 0;
+				for (uint32_t streamIndex = 0; streamIndex < layout.m_Streams.size(); ++streamIndex)
+				{
+					const MsfzStream& streamDesc = layout.m_Streams[streamIndex];
+					const uint32_t streamSize = streamDesc.CalculateSize();
+					if (isFastLoadPolicy)
+					{
+						// the DBI stream is read as a whole when the PDB is opened, and streams of up to 256 bytes aren't compressed
+						if (streamIndex == g_DbiStreamIndex && streamDesc.m_Fragments.size() > 1)
+						{
+							ynw::ThrowError("%s: the DBI stream is split into %llu fragments.", outputPath.c_str(), streamDesc.m_Fragments.size());
+						}
+						for (const MsfzFragment& fragmentDesc : streamDesc.m_Fragments)
+						{
+							if (streamSize <= 256 && fragmentDesc.IsLocatedInChunk() && layout.m_Chunks[fragmentDesc.GetChunkIndex()].m_IsCompressed)
+							{
+								ynw::ThrowError("%s: stream %u only has %u bytes, but is compressed.", outputPath.c_str(), streamIndex, streamSize);
+							}
+						}
+					}
+					else if (streamSize < 0x4000000 && streamDesc.m_Fragments.size() > 1)
+					{
+						ynw::ThrowError("%s: stream %u is smaller than 64MB, but is split into %llu fragments.", outputPath.c_str(), streamIndex, streamDesc.m_Fragments.size());
+					}
+				}
+			}
+		}
+
+		std::vector<char> CompressIntoMemory(ProgramCommandLineArgs args, const std::string& variantName)
+		{
+			args.m_OutputFilePath = std::filesystem::path(GetOutputFileName(args)).replace_extension(variantName + ".pdb").string();
+			g_CurrentProgressTracker->UpdateProgress(1);
+			{
+				SuppressLogInScope();
+				Compression::RunCompression(args);
+			}
+
+			std::ifstream outputFile(args.m_OutputFilePath, std::ios::binary);
+			return std::vector<char>(std::istreambuf_iterator<char>(outputFile), std::istreambuf_iterator<char>());
+		}
+
+		// the output mustn't depend on how the work got split between threads, nor on whether the input was mapped or read on demand
+		void TestReproducibleOutput(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::MultiFragment);
+			const uint32_t defaultNumThreads = ynw::ThreadConfig::GetDefaultNumThreads();
+			ynw::ThreadConfig::SetDefaultNumThreads(1);
+			const std::vector<char> singleThreadedOutput = CompressIntoMemory(args, "t1");
+			ynw::ThreadConfig::SetDefaultNumThreads(std::max(2u, defaultNumThreads));
+			const std::vector<char> multiThreadedOutput = CompressIntoMemory(args, "tN");
+			ynw::ThreadConfig::SetDefaultNumThreads(defaultNumThreads);
+			if (singleThreadedOutput != multiThreadedOutput)
+			{
+				ynw::ThrowError("Compressing %s with a different number of threads produced a different output.", inputPath);
+			}
+
+			// record aligned fragments, raw chunks and fragments larger than zstd's window all depend on reading the input the same way
+			args.m_AlignFragmentsToRecords = true;
+			for (const uint32_t fragmentSize : { 0x100u, 0x4000u, 0x400000u })
+			{
+				args.m_FixedFragmentSize = fragmentSize;
+				args.m_MaxFragmentsPerStream = 0x3001;
+				args.m_InputMemoryLimitMB.reset();
+				const std::vector<char> mappedInputOutput = CompressIntoMemory(args, "mapped");
+				// with 1MB, most ranges are read block run by block run, with 64MB most of them are fetched into memory as a whole
+				for (const uint32_t inputMemoryLimitMB : { 1u, 64u })
+				{
+					args.m_InputMemoryLimitMB = inputMemoryLimitMB;
+					if (CompressIntoMemory(args, "streamed") != mappedInputOutput)
+					{
+						ynw::ThrowError("Compressing %s with mapped and streamed input produced a different output. Fragment size: %u, Input memory limit: %uMB", inputPath, fragmentSize, inputMemoryLimitMB);
+					}
+				}
+			}
+		}
+
+		// every change of the thread configuration brings up a new pool, whose workers pin themselves while the pool is still starting the others
+		void TestNumaPinnedWorkers(const char* inputPath)
+		{
+			ProgramCommandLineArgs args = GetBaseArgs(inputPath, CompressionStrategy::MultiFragment);
+			const uint32_t defaultNumThreads = ynw::ThreadConfig::GetDefaultNumThreads();
+			const bool defaultPinWorkersToNumaNodes = ynw::ThreadConfig::GetPinWorkersToNumaNodes();
+			ynw::ThreadConfig::SetPinWorkersToNumaNodes(true);
+			for (const uint32_t numThreads : { 2u, std::max(16u, defaultNumThreads) })
+			{
+				ynw::ThreadConfig::SetDefaultNumThreads(numThreads);
+				TestWithArgs(args);
+			}
+			ynw::ThreadConfig::SetDefaultNumThreads(defaultNumThreads);
+			ynw::ThreadConfig::SetPinWorkersToNumaNodes(defaultPinWorkersToNumaNodes);
+		}
+
 		void TestEverything(const char* inputPath)
 		{
 			TestDifferentStrategies(inputPath);
 			TestDifferentFragmentSizes(inputPath);
+			TestStreamedInput(inputPath);
+			TestRecordAlignedFragments(inputPath);
+			TestLoadOrderLayout(inputPath);
+			TestPackedChunks(inputPath);
+			TestRawStreams(inputPath);
+			TestRawChunkThresholds(inputPath);
+			TestAlignedRawChunks(inputPath);
+			TestCompressionPolicies(inputPath);
+			TestReproducibleOutput(inputPath);
+			TestNumaPinnedWorkers(inputPath);
 		}
 	}
 
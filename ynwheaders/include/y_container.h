@@ -2,7 +2,16 @@
 
 #include <vector>
 #include <span>
+#include <cstring>
 #include <cassert>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define YNW_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "y_misc.h"
 
 namespace ynw
 {
@@ -160,4 +169,49 @@ namespace ynw
 		std::vector<uint8_t> m_Data;
 		uint8_t m_ModularSizeInBits = 0;
 	};
+
+	// A run of consecutive indices [m_First, m_First + m_Count)
+	struct IndexRun
+	{
+		uint32_t m_First = 0;
+		uint32_t m_Count = 0;
+	};
+
+	// Returns the end (exclusive) of the run of consecutive values starting at values[begin], i.e. the first i > begin for which
+	// values[i] != values[i - 1] + 1. Four neighbouring pairs are compared per step where SSE2 is available.
+	inline size_t FindConsecutiveRunEnd(const std::span<const uint32_t>& values, size_t begin)
+	{
+		size_t i = begin + 1;
+#ifdef YNW_HAS_SSE2
+		const __m128i ones = _mm_set1_epi32(1);
+		for (; i + 4 <= values.size(); i += 4)
+		{
+			const __m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values.data() + i));
+			const __m128i previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values.data() + i - 1));
+			const __m128i isConsecutive = _mm_cmpeq_epi32(_mm_sub_epi32(current, previous), ones);
+			const uint32_t mask = static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(isConsecutive)));
+			if (mask != 0xF)
+			{
+				return i + std::countr_one(mask);
+			}
+		}
+#endif
+		while (i < values.size() && values[i] == values[i - 1] + 1)
+		{
+			++i;
+		}
+		return i;
+	}
+
+	// Splits a list of indices into runs of consecutive indices, in order
+	inline void SplitIntoConsecutiveRuns(const std::span<const uint32_t>& values, std::vector<IndexRun>& outRuns)
+	{
+		outRuns.clear();
+		for (size_t runBegin = 0; runBegin < values.size();)
+		{
+			const size_t runEnd = FindConsecutiveRunEnd(values, runBegin);
+			outRuns.push_back({ values[runBegin], StrictCastTo<uint32_t>(runEnd - runBegin) });
+			runBegin = runEnd;
+		}
+	}
 }
\ No newline at end of file
@@ -2,8 +2,12 @@
 
 #include <span>
 #include <vector>
+#include <mutex>
+#include <cstring>
 #include <cassert>
 
+#include "y_misc.h"
+
 namespace ynw
 {
 	class MutableStreamFixed
@@ -125,37 +129,6 @@ namespace ynw
 		std::vector<uint8_t> m_OwnedData;
 	};
 
-	class SimpleMutableStreamFixedThreadSafe : public MutableStreamFixed
-	{
-	public:
-		using MutableStreamFixed::MutableStreamFixed;
-
-		SimpleMutableStreamFixedThreadSafe(const MutableStreamFixed& srcStream)
-			: MutableStreamFixed(srcStream)
-		{
-		}
-
-		MutableStreamFixed GetRegionSubstreamForWriting(const uint64_t regionSize, uint64_t& outRegionOffset)
-		{
-			m_Mutex.lock();
-			if (m_Offset + regionSize > m_Size)
-			{
-				m_Mutex.unlock();
-				return MutableStreamFixed{ nullptr, 0 };
-			}
-
-			outRegionOffset = m_Offset;
-			m_Offset += regionSize;
-
-			MutableStreamFixed subStream(m_Data + outRegionOffset, regionSize);
-			m_Mutex.unlock();
-			return subStream;
-		}
-
-	private:
-		std::mutex m_Mutex;
-	};
-
 	class MutableStreamDynamicThreadSafe : public MutableStreamDynamic
 	{
 	public:
@@ -275,6 +248,9 @@ namespace ynw
 			return true;
 		}
 
+		uint64_t GetOffset() const { return m_Offset; }
+		uint64_t GetSize() const { return m_Length; }
+
 	private:
 		const uint8_t* m_Data;
 		uint64_t m_Length;
@@ -2,9 +2,17 @@
 
 #ifdef _WIN32
 #include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
 
 namespace ynw
 {
@@ -34,7 +42,8 @@ namespace ynw
 			return false;	// if we fail, there's a chance the data etc is unmapped. rip.
 		}
 
-		bool Open(bool forWrite, bool overwriteExisting = true)
+		// files opened for reading are mapped right away, unless mapForReading is false, in which case they can only be accessed through ReadAt()
+		bool Open(bool forWrite, bool overwriteExisting = true, bool mapForReading = true)
 		{
 			m_Handle = CreateFileA(m_Path.c_str(),
 				forWrite ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
@@ -51,6 +60,16 @@ namespace ynw
 				{
 					return true;
 				}
+				else if (!mapForReading)
+				{
+					LARGE_INTEGER fileSize;
+					if (!GetFileSizeEx(m_Handle, &fileSize))
+					{
+						return false;
+					}
+					m_Size = static_cast<uint64_t>(fileSize.QuadPart);
+					return true;
+				}
 				else
 				{
 					return Map();
@@ -59,6 +78,50 @@ namespace ynw
 			return false;
 		}
 
+		// positional read that doesn't go through the mapping, safe to call from multiple threads
+		bool ReadAt(uint64_t offset, void* outData, size_t numBytes) const
+		{
+			uint8_t* outBytes = static_cast<uint8_t*>(outData);
+			while (numBytes > 0)
+			{
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = static_cast<DWORD>(offset);
+				overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+				const DWORD numBytesToRead = static_cast<DWORD>(std::min<size_t>(numBytes, 1u << 30));
+				DWORD numBytesRead = 0;
+				if (!ReadFile(m_Handle, outBytes, numBytesToRead, &numBytesRead, &overlapped) || numBytesRead == 0)
+				{
+					return false;
+				}
+				outBytes += numBytesRead;
+				offset += numBytesRead;
+				numBytes -= numBytesRead;
+			}
+			return true;
+		}
+
+		// positional write that doesn't go through the mapping, extends the file if needed
+		bool WriteAt(uint64_t offset, const void* data, size_t numBytes)
+		{
+			const uint8_t* srcBytes = static_cast<const uint8_t*>(data);
+			while (numBytes > 0)
+			{
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = static_cast<DWORD>(offset);
+				overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+				const DWORD numBytesToWrite = static_cast<DWORD>(std::min<size_t>(numBytes, 1u << 30));
+				DWORD numBytesWritten = 0;
+				if (!WriteFile(m_Handle, srcBytes, numBytesToWrite, &numBytesWritten, &overlapped) || numBytesWritten == 0)
+				{
+					return false;
+				}
+				srcBytes += numBytesWritten;
+				offset += numBytesWritten;
+				numBytes -= numBytesWritten;
+			}
+			return true;
+		}
+
 		bool Map()
 		{
 			Unmap();
@@ -106,6 +169,18 @@ namespace ynw
 
 		}
 
+		// hints that a part of the mapping is about to be read, so that the OS can start reading it in the background
+		void Prefetch(uint64_t offset, size_t numBytes) const
+		{
+			if (m_ViewOfFile != INVALID_HANDLE_VALUE && offset < m_Size)
+			{
+				WIN32_MEMORY_RANGE_ENTRY memoryRange = {};
+				memoryRange.VirtualAddress = static_cast<uint8_t*>(m_ViewOfFile) + offset;
+				memoryRange.NumberOfBytes = static_cast<size_t>(std::min<uint64_t>(numBytes, m_Size - offset));
+				PrefetchVirtualMemory(GetCurrentProcess(), 1, &memoryRange, 0);
+			}
+		}
+
 		void* GetData() const { return m_ViewOfFile; }
 		uint64_t GetSize() const { return m_Size; }
 
@@ -123,5 +198,268 @@ namespace ynw
 		HANDLE m_ViewOfFile = INVALID_HANDLE_VALUE;
 		uint64_t m_Size = 0;
 	};
+
+	using SimpleFile = SimpleWinFile;
+#else
+	// Same contract as SimpleWinFile: files opened for reading are mapped immediately,
+	// files opened for writing are mapped once they're given a size via Resize().
+	class SimplePosixFile
+	{
+	public:
+		SimplePosixFile(const char* path)
+			: m_Path(path)
+		{
+		}
+
+		bool Resize(uint64_t newSize)
+		{
+#ifdef __linux__
+			if (m_ViewOfFile != nullptr && newSize != 0)
+			{
+				// shrink the view before truncating so that it never points past EOF, grow it only after the file has been extended
+				if (newSize < m_Size && !RemapView(newSize))
+				{
+					return false;
+				}
+				if (ftruncate(m_Handle, static_cast<off_t>(newSize)) != 0)
+				{
+					return false;
+				}
+				return newSize <= m_Size || RemapView(newSize);
+			}
+#endif
+			Unmap();
+			if (ftruncate(m_Handle, static_cast<off_t>(newSize)) != 0)
+			{
+				return false;
+			}
+			return Map();
+		}
+
+		bool Open(bool forWrite, bool overwriteExisting = true, bool mapForReading = true)
+		{
+			const int openFlags = forWrite ? (O_RDWR | O_CREAT | (overwriteExisting ? O_TRUNC : O_EXCL)) : O_RDONLY;
+			m_Handle = open(m_Path.c_str(), openFlags | O_CLOEXEC, 0644);
+
+			m_IsWritable = forWrite;
+			if (m_Handle != -1)
+			{
+				if (m_IsWritable)
+				{
+					return true;
+				}
+				else if (!mapForReading)
+				{
+					struct stat fileStat = {};
+					if (fstat(m_Handle, &fileStat) != 0)
+					{
+						return false;
+					}
+					m_Size = static_cast<uint64_t>(fileStat.st_size);
+					return true;
+				}
+				else
+				{
+					return Map();
+				}
+			}
+			return false;
+		}
+
+		bool ReadAt(uint64_t offset, void* outData, size_t numBytes) const
+		{
+			uint8_t* outBytes = static_cast<uint8_t*>(outData);
+			while (numBytes > 0)
+			{
+				const ssize_t numBytesRead = pread(m_Handle, outBytes, numBytes, static_cast<off_t>(offset));
+				if (numBytesRead <= 0)
+				{
+					return false;
+				}
+				outBytes += numBytesRead;
+				offset += static_cast<uint64_t>(numBytesRead);
+				numBytes -= static_cast<size_t>(numBytesRead);
+			}
+			return true;
+		}
+
+		bool WriteAt(uint64_t offset, const void* data, size_t numBytes)
+		{
+			const uint8_t* srcBytes = static_cast<const uint8_t*>(data);
+			while (numBytes > 0)
+			{
+				const ssize_t numBytesWritten = pwrite(m_Handle, srcBytes, numBytes, static_cast<off_t>(offset));
+				if (numBytesWritten <= 0)
+				{
+					return false;
+				}
+				srcBytes += numBytesWritten;
+				offset += static_cast<uint64_t>(numBytesWritten);
+				numBytes -= static_cast<size_t>(numBytesWritten);
+			}
+			return true;
+		}
+
+		bool Map()
+		{
+			Unmap();
+
+			struct stat fileStat = {};
+			if (fstat(m_Handle, &fileStat) != 0)
+			{
+				return false;
+			}
+
+			m_Size = static_cast<uint64_t>(fileStat.st_size);
+			if (m_Size == 0)
+			{
+				// mmap refuses empty mappings, treat an empty file as a valid but dataless view
+				return true;
+			}
+
+			void* viewOfFile = mmap(nullptr, static_cast<size_t>(m_Size), m_IsWritable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, m_Handle, 0);
+			if (viewOfFile == MAP_FAILED)
+			{
+				m_Size = 0;
+				return false;
+			}
+
+			m_ViewOfFile = viewOfFile;
+			return true;
+		}
+
+		void Unmap()
+		{
+			if (m_ViewOfFile != nullptr)
+			{
+				munmap(m_ViewOfFile, static_cast<size_t>(m_Size));
+				m_ViewOfFile = nullptr;
+			}
+		}
+
+		void Prefetch(uint64_t offset, size_t numBytes) const
+		{
+			if (m_ViewOfFile != nullptr && offset < m_Size)
+			{
+				// madvise wants a page aligned address
+				const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+				const uint64_t alignedOffset = offset - offset % pageSize;
+				const size_t numAlignedBytes = static_cast<size_t>(std::min<uint64_t>(offset + numBytes, m_Size) - alignedOffset);
+				madvise(static_cast<uint8_t*>(m_ViewOfFile) + alignedOffset, numAlignedBytes, MADV_WILLNEED);
+			}
+		}
+
+		void* GetData() const { return m_ViewOfFile; }
+		uint64_t GetSize() const { return m_Size; }
+
+		~SimplePosixFile()
+		{
+			Unmap();
+			if (m_Handle != -1)
+			{
+				close(m_Handle);
+			}
+		}
+
+	private:
+#ifdef __linux__
+		// the view is file-backed, so mremap only rewrites page tables and never copies the mapped data
+		bool RemapView(uint64_t newSize)
+		{
+			void* viewOfFile = mremap(m_ViewOfFile, static_cast<size_t>(m_Size), static_cast<size_t>(newSize), MREMAP_MAYMOVE);
+			if (viewOfFile == MAP_FAILED)
+			{
+				return false;
+			}
+			m_ViewOfFile = viewOfFile;
+			m_Size = newSize;
+			return true;
+		}
+#endif
+
+		std::string m_Path;
+		bool m_IsWritable = false;
+		int m_Handle = -1;
+		void* m_ViewOfFile = nullptr;
+		uint64_t m_Size = 0;
+	};
+
+	using SimpleFile = SimplePosixFile;
 #endif
+
+	// Appends data to the end of a file through a fixed-size buffer instead of mapping it, so the file only ever grows by
+	// as much as is actually written. Writes larger than the buffer bypass it, and regions can be reserved to be filled in
+	// later with WriteAt(), e.g. headers whose contents aren't known until everything else has been written.
+	class BufferedFileWriter
+	{
+	public:
+		BufferedFileWriter(SimpleFile& file, size_t bufferSize = 1 << 20)
+			: m_File(file)
+			, m_BufferCapacity(bufferSize)
+		{
+			m_Buffer.reserve(bufferSize);
+		}
+
+		bool Append(const void* data, size_t numBytes)
+		{
+			if (m_Buffer.size() + numBytes > m_BufferCapacity && !Flush())
+			{
+				return false;
+			}
+
+			if (numBytes >= m_BufferCapacity)
+			{
+				if (!m_File.WriteAt(m_Offset, data, numBytes))
+				{
+					return false;
+				}
+				m_Offset += numBytes;
+				m_BufferOffset = m_Offset;
+				return true;
+			}
+
+			const uint8_t* srcBytes = static_cast<const uint8_t*>(data);
+			m_Buffer.insert(m_Buffer.end(), srcBytes, srcBytes + numBytes);
+			m_Offset += numBytes;
+			return true;
+		}
+
+		bool Reserve(size_t numBytes, uint64_t& outOffset)
+		{
+			if (!Flush())
+			{
+				return false;
+			}
+			outOffset = m_Offset;
+			m_Offset += numBytes;
+			m_BufferOffset = m_Offset;
+			return true;
+		}
+
+		bool WriteAt(uint64_t offset, const void* data, size_t numBytes)
+		{
+			return m_File.WriteAt(offset, data, numBytes);
+		}
+
+		bool Flush()
+		{
+			bool result = true;
+			if (!m_Buffer.empty())
+			{
+				result = m_File.WriteAt(m_BufferOffset, m_Buffer.data(), m_Buffer.size());
+				m_Buffer.clear();
+			}
+			m_BufferOffset = m_Offset;
+			return result;
+		}
+
+		uint64_t GetOffset() const { return m_Offset; }
+
+	private:
+		SimpleFile& m_File;
+		std::vector<uint8_t> m_Buffer;
+		size_t m_BufferCapacity = 0;
+		uint64_t m_BufferOffset = 0;
+		uint64_t m_Offset = 0;
+	};
 }
\ No newline at end of file
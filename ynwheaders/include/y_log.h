@@ -6,6 +6,7 @@
 #include <cstdarg>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 
 #define LogScoped(message) ynw::LogScopedVar uniqueScopedLog(message)
 #define SuppressLogInScope() ynw::SuppressLogScope uniqueSuppressLog
@@ -109,7 +110,7 @@ namespace ynw
 		std::mutex m_Mutex;
 	};
 
-	inline __declspec(noreturn) void ThrowError(const char* formatString, ...)
+	[[noreturn]] inline void ThrowError(const char* formatString, ...)
 	{
 		printf("\r\nFatal error: ");
 		va_list argList;
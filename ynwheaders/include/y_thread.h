@@ -5,10 +5,27 @@
 #include <atomic>
 #include <algorithm>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <functional>
+#include <numeric>
+#include <condition_variable>
+
+#include <optional>
+#include <string>
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+#include <bit>
+#include <cstddef>
+#include <cassert>
 
 #ifdef _WIN32
 #include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
 #endif
 
 namespace ynw
@@ -22,86 +39,680 @@ namespace ynw
 			{
 				return g_DefaultNumThreads;
 			}
-			else
+
+			// the affinity mask and cpu quota are only read once, so asking for the thread count stays cheap, and the pool isn't rebuilt
+			// under a running job when the quota changes
+			static const uint32_t g_DetectedNumThreads = DetectNumThreads();
+			return g_DetectedNumThreads;
+		}
+
+		// pins each worker thread to the processors of one NUMA node, spreading the workers evenly over the nodes. Memory a worker touches
+		// first (e.g. its scratch buffers) then gets allocated on its own node.
+		static void SetPinWorkersToNumaNodes(const bool pinWorkers) { g_PinWorkersToNumaNodes = pinWorkers; }
+		static bool GetPinWorkersToNumaNodes() { return g_PinWorkersToNumaNodes; }
+
+		static void PinCurrentThreadToNumaNode(const uint32_t workerIndex, const uint32_t numWorkers)
+		{
+			static const std::vector<NumaNodeAffinity> g_NumaNodeAffinities = GetNumaNodeAffinities();
+			if (g_NumaNodeAffinities.empty())
 			{
-				constexpr float k_ThreadUsageRatio = 0.75;	// use 3/4 of available cores
+				return;
+			}
+
+			const NumaNodeAffinity& nodeAffinity = g_NumaNodeAffinities[static_cast<uint64_t>(workerIndex) * g_NumaNodeAffinities.size() / numWorkers];
 #ifdef _WIN32
-				SYSTEM_INFO systemInfo = {};
-				GetSystemInfo(&systemInfo);
-				return static_cast<uint32_t>(systemInfo.dwNumberOfProcessors * k_ThreadUsageRatio);
+			SetThreadGroupAffinity(GetCurrentThread(), &nodeAffinity, nullptr);
 #else
-				static_assert(!"Default thread detection not implemented for non-windows platforms.");
+			pthread_setaffinity_np(pthread_self(), sizeof(nodeAffinity), &nodeAffinity);
 #endif
-			}
 		}
 
 	private:
+		// when the process may only use part of the machine (affinity mask, cgroup cpu quota), that part is what it's been given to use,
+		// otherwise leave some of the cores to the rest of the system
+		static uint32_t DetectNumThreads()
+		{
+			constexpr float k_ThreadUsageRatio = 0.75;	// use 3/4 of available cores
+			const uint32_t numSystemProcessors = std::max(1u, std::thread::hardware_concurrency());
+			const uint32_t numAvailableProcessors = GetNumAvailableProcessors();
+			if (numAvailableProcessors < numSystemProcessors)
+			{
+				return numAvailableProcessors;
+			}
+			return std::max(1u, static_cast<uint32_t>(numSystemProcessors * k_ThreadUsageRatio));
+		}
+
+#ifdef _WIN32
+		using NumaNodeAffinity = GROUP_AFFINITY;
+
+		static uint32_t GetNumAvailableProcessors()
+		{
+			uint32_t numProcessors = static_cast<uint32_t>(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+			DWORD_PTR processAffinityMask = 0;
+			DWORD_PTR systemAffinityMask = 0;
+			if (GetProcessAffinityMask(GetCurrentProcess(), &processAffinityMask, &systemAffinityMask) && processAffinityMask != 0)
+			{
+				numProcessors = std::min<uint32_t>(numProcessors, std::popcount(static_cast<uint64_t>(processAffinityMask)));
+			}
+			return std::max(1u, numProcessors);
+		}
+
+		static std::vector<NumaNodeAffinity> GetNumaNodeAffinities()
+		{
+			std::vector<NumaNodeAffinity> nodeAffinities;
+			ULONG highestNodeNumber = 0;
+			if (GetNumaHighestNodeNumber(&highestNodeNumber))
+			{
+				for (USHORT node = 0; node <= highestNodeNumber; ++node)
+				{
+					GROUP_AFFINITY nodeAffinity = {};
+					if (GetNumaNodeProcessorMaskEx(node, &nodeAffinity) && nodeAffinity.Mask != 0)
+					{
+						nodeAffinities.push_back(nodeAffinity);
+					}
+				}
+			}
+			return nodeAffinities;
+		}
+#else
+		using NumaNodeAffinity = cpu_set_t;
+
+		static uint32_t GetNumAvailableProcessors()
+		{
+			uint32_t numProcessors = std::max(1u, std::thread::hardware_concurrency());
+			cpu_set_t processAffinity;
+			if (sched_getaffinity(0, sizeof(processAffinity), &processAffinity) == 0)
+			{
+				numProcessors = std::min<uint32_t>(numProcessors, CPU_COUNT(&processAffinity));
+			}
+			if (const std::optional<double> cpuQuota = GetCgroupCpuQuota())
+			{
+				numProcessors = std::min(numProcessors, static_cast<uint32_t>(std::ceil(*cpuQuota)));
+			}
+			return std::max(1u, numProcessors);
+		}
+
+		// number of cpus worth of time the process' cgroup (or any of its ancestors) is allowed to use, if limited.
+		// handles both cgroup v2 (cpu.max) and the v1 cpu controller (cpu.cfs_quota_us / cpu.cfs_period_us).
+		static std::optional<double> GetCgroupCpuQuota()
+		{
+			std::optional<double> cpuQuota;
+			auto applyQuota = [&cpuQuota](const int64_t quota, const int64_t period)
+				{
+					if (quota > 0 && period > 0)
+					{
+						const double quotaCpus = static_cast<double>(quota) / static_cast<double>(period);
+						cpuQuota = cpuQuota.has_value() ? std::min(*cpuQuota, quotaCpus) : quotaCpus;
+					}
+				};
+
+			// calls fn with the directory of the cgroup under the mount point, then with each of its ancestors up to the mount point itself.
+			// inside a container the cgroup path usually isn't visible under the mount, in which case only the mount point is left to check.
+			auto forEachCgroupDirectory = [](const std::string& mountPoint, std::string cgroupPath, auto&& fn)
+				{
+					while (!cgroupPath.empty() && cgroupPath != "/")
+					{
+						fn(mountPoint + cgroupPath);
+						cgroupPath.resize(cgroupPath.find_last_of('/'));
+					}
+					fn(mountPoint);
+				};
+
+			std::ifstream cgroupFile("/proc/self/cgroup");
+			std::string line;
+			while (std::getline(cgroupFile, line))
+			{
+				// hierarchy-id:controller-list:cgroup-path, the controller list is empty for the v2 hierarchy
+				const size_t controllersBegin = line.find(':');
+				const size_t controllersEnd = controllersBegin == std::string::npos ? std::string::npos : line.find(':', controllersBegin + 1);
+				if (controllersEnd == std::string::npos)
+				{
+					continue;
+				}
+
+				const std::string controllers = "," + line.substr(controllersBegin + 1, controllersEnd - controllersBegin - 1) + ",";
+				const std::string cgroupPath = line.substr(controllersEnd + 1);
+				if (controllers == ",,")
+				{
+					forEachCgroupDirectory("/sys/fs/cgroup", cgroupPath, [&applyQuota](const std::string& directory)
+						{
+							// "max <period>" when not limited
+							std::ifstream cpuMaxFile(directory + "/cpu.max");
+							std::string quota;
+							int64_t period = 0;
+							if (cpuMaxFile >> quota >> period && quota != "max")
+							{
+								applyQuota(std::strtoll(quota.c_str(), nullptr, 10), period);
+							}
+						});
+				}
+				else if (controllers.find(",cpu,") != std::string::npos)
+				{
+					for (const char* mountPoint : { "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu" })
+					{
+						forEachCgroupDirectory(mountPoint, cgroupPath, [&applyQuota](const std::string& directory)
+							{
+								// quota is -1 when not limited
+								std::ifstream quotaFile(directory + "/cpu.cfs_quota_us");
+								std::ifstream periodFile(directory + "/cpu.cfs_period_us");
+								int64_t quota = 0;
+								int64_t period = 0;
+								if (quotaFile >> quota && periodFile >> period)
+								{
+									applyQuota(quota, period);
+								}
+							});
+					}
+				}
+			}
+			return cpuQuota;
+		}
+
+		// processors of each NUMA node that the process is allowed to run on, nodes without any such processors are left out
+		static std::vector<NumaNodeAffinity> GetNumaNodeAffinities()
+		{
+			std::vector<NumaNodeAffinity> nodeAffinities;
+			cpu_set_t processAffinity;
+			if (sched_getaffinity(0, sizeof(processAffinity), &processAffinity) != 0)
+			{
+				return nodeAffinities;
+			}
+
+			for (uint32_t node = 0; ; ++node)
+			{
+				// comma separated list of processor ranges, e.g. "0-15,32-47"
+				std::ifstream cpuListFile("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+				if (!cpuListFile)
+				{
+					break;
+				}
+
+				cpu_set_t nodeAffinity;
+				CPU_ZERO(&nodeAffinity);
+				std::string cpuRange;
+				while (std::getline(cpuListFile, cpuRange, ','))
+				{
+					char* rangeEnd = nullptr;
+					const long firstCpu = std::strtol(cpuRange.c_str(), &rangeEnd, 10);
+					const long lastCpu = *rangeEnd == '-' ? std::strtol(rangeEnd + 1, nullptr, 10) : firstCpu;
+					for (long cpu = firstCpu; cpu <= lastCpu && cpu < CPU_SETSIZE; ++cpu)
+					{
+						if (CPU_ISSET(cpu, &processAffinity))
+						{
+							CPU_SET(cpu, &nodeAffinity);
+						}
+					}
+				}
+
+				if (CPU_COUNT(&nodeAffinity) != 0)
+				{
+					nodeAffinities.push_back(nodeAffinity);
+				}
+			}
+			return nodeAffinities;
+		}
+#endif
+
 		static inline uint32_t g_DefaultNumThreads = 0;
+		static inline bool g_PinWorkersToNumaNodes = false;
+	};
+
+	// Index of the calling thread among the worker threads of the ThreadPool, in [0, numThreads).
+	// Lets jobs keep per-worker state (e.g. scratch buffers, compression contexts) in a plain vector indexed by worker.
+	// Such state is best allocated by the worker itself on first use, so that it's local to the worker's node when workers are pinned.
+	struct WorkerThread
+	{
+		static uint32_t GetIndex() { return g_WorkerIndex; }
+		static bool IsPoolWorker() { return g_IsPoolWorker; }
+
+	private:
+		friend class ThreadPool;
+		static inline thread_local uint32_t g_WorkerIndex = 0;
+		static inline thread_local bool g_IsPoolWorker = false;
 	};
 
+	// Long-lived pool of worker threads, so that running a parallel loop doesn't spawn and join threads every time.
+	// Each worker has its own task queue: it takes its newest task first and steals the oldest task of another worker when its queue is empty.
+	// Tasks submitted from outside of the pool go through a shared injection queue.
+	class ThreadPool
+	{
+	public:
+		using Task = std::function<void()>;
+
+		// the pool is set up after ThreadConfig and recreated if the configuration changes between uses.
+		// it's never destroyed, so that a worker thread calling exit() never ends up joining itself.
+		static ThreadPool& Get()
+		{
+			static std::mutex g_PoolMutex;
+			static ThreadPool* g_Pool = nullptr;
+
+			std::lock_guard<std::mutex> lock(g_PoolMutex);
+			const uint32_t numThreads = ThreadConfig::GetDefaultNumThreads();
+			const bool pinWorkersToNumaNodes = ThreadConfig::GetPinWorkersToNumaNodes();
+			const bool isConfigChanged = g_Pool != nullptr && (g_Pool->GetNumThreads() != numThreads || g_Pool->m_PinsWorkersToNumaNodes != pinWorkersToNumaNodes);
+			if (g_Pool == nullptr || (isConfigChanged && !WorkerThread::IsPoolWorker()))
+			{
+				delete g_Pool;
+				g_Pool = new ThreadPool(numThreads, pinWorkersToNumaNodes);
+			}
+			return *g_Pool;
+		}
+
+		template <typename TaskFn>
+		void Submit(TaskFn&& taskFn)
+		{
+			if (WorkerThread::IsPoolWorker())
+			{
+				WorkerQueue& workerQueue = *m_WorkerQueues[WorkerThread::GetIndex()];
+				std::lock_guard<std::mutex> lock(workerQueue.m_Mutex);
+				workerQueue.m_Tasks.emplace_back(std::forward<TaskFn>(taskFn));
+			}
+			else
+			{
+				std::lock_guard<std::mutex> lock(m_InjectionQueue.m_Mutex);
+				m_InjectionQueue.m_Tasks.emplace_back(std::forward<TaskFn>(taskFn));
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_SleepMutex);
+				++m_NumQueuedTasks;
+			}
+			m_SleepCondition.notify_one();
+		}
+
+		uint32_t GetNumThreads() const { return static_cast<uint32_t>(m_Threads.size()); }
+
+	private:
+		struct WorkerQueue
+		{
+			std::mutex m_Mutex;
+			std::deque<Task> m_Tasks;
+		};
+
+		ThreadPool(const uint32_t numThreads, const bool pinWorkersToNumaNodes)
+			: m_PinsWorkersToNumaNodes(pinWorkersToNumaNodes)
+		{
+			m_WorkerQueues.reserve(numThreads);
+			for (uint32_t i = 0; i < numThreads; ++i)
+			{
+				m_WorkerQueues.push_back(std::make_unique<WorkerQueue>());
+			}
+			m_Threads.reserve(numThreads);
+			for (uint32_t i = 0; i < numThreads; ++i)
+			{
+				// workers start running while m_Threads is still being filled, so they're handed the thread count rather than reading it from there
+				m_Threads.emplace_back(&ThreadPool::WorkerThreadFn, this, i, numThreads);
+			}
+		}
+
+		~ThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_SleepMutex);
+				m_IsShuttingDown = true;
+			}
+			m_SleepCondition.notify_all();
+			for (std::thread& thread : m_Threads)
+			{
+				thread.join();
+			}
+		}
+
+		bool TryPopTask(const uint32_t workerIndex, Task& outTask)
+		{
+			auto tryPopFrom = [&outTask](WorkerQueue& queue, const bool newestFirst)
+				{
+					std::lock_guard<std::mutex> lock(queue.m_Mutex);
+					if (queue.m_Tasks.empty())
+					{
+						return false;
+					}
+					if (newestFirst)
+					{
+						outTask = std::move(queue.m_Tasks.back());
+						queue.m_Tasks.pop_back();
+					}
+					else
+					{
+						outTask = std::move(queue.m_Tasks.front());
+						queue.m_Tasks.pop_front();
+					}
+					return true;
+				};
+
+			if (tryPopFrom(*m_WorkerQueues[workerIndex], true) || tryPopFrom(m_InjectionQueue, false))
+			{
+				return true;
+			}
+			for (uint32_t i = 1; i < m_WorkerQueues.size(); ++i)
+			{
+				if (tryPopFrom(*m_WorkerQueues[(workerIndex + i) % m_WorkerQueues.size()], false))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void WorkerThreadFn(const uint32_t workerIndex, const uint32_t numThreads)
+		{
+			WorkerThread::g_WorkerIndex = workerIndex;
+			WorkerThread::g_IsPoolWorker = true;
+			if (m_PinsWorkersToNumaNodes)
+			{
+				ThreadConfig::PinCurrentThreadToNumaNode(workerIndex, numThreads);
+			}
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_SleepMutex);
+					m_SleepCondition.wait(lock, [this]() { return m_NumQueuedTasks != 0 || m_IsShuttingDown; });
+					if (m_NumQueuedTasks == 0)
+					{
+						return;
+					}
+					--m_NumQueuedTasks;
+				}
+
+				// the task this worker has been woken up for may have been taken by another worker in the meantime, in which case there's one
+				// left somewhere for it to take instead
+				Task task;
+				while (!TryPopTask(workerIndex, task))
+				{
+					std::this_thread::yield();
+				}
+				task();
+			}
+		}
+
+		std::vector<std::thread> m_Threads;
+		std::vector<std::unique_ptr<WorkerQueue>> m_WorkerQueues;
+		WorkerQueue m_InjectionQueue;
+		std::mutex m_SleepMutex;
+		std::condition_variable m_SleepCondition;
+		size_t m_NumQueuedTasks = 0;
+		bool m_IsShuttingDown = false;
+		bool m_PinsWorkersToNumaNodes = false;
+	};
+
+	// Bounded multi-producer multi-consumer queue, a ring of slots that each carry a sequence number telling producers and consumers
+	// whose turn it is, so pushing and popping never take a lock. Push() and Pop() only wait when the queue is full or empty respectively.
+	template <typename T>
+	class BoundedQueue
+	{
+	public:
+		BoundedQueue(const size_t minCapacity)
+			: m_Capacity(std::bit_ceil(std::max<size_t>(minCapacity, 2)))
+			, m_Slots(new Slot[m_Capacity])
+		{
+			for (size_t i = 0; i < m_Capacity; ++i)
+			{
+				m_Slots[i].m_Sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		bool TryPush(T&& value)
+		{
+			size_t position = m_PushPosition.load(std::memory_order_relaxed);
+			while (true)
+			{
+				Slot& slot = m_Slots[position & (m_Capacity - 1)];
+				const size_t sequence = slot.m_Sequence.load(std::memory_order_acquire);
+				if (sequence == position)
+				{
+					if (m_PushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					{
+						slot.m_Value = std::move(value);
+						slot.m_Sequence.store(position + 1, std::memory_order_release);
+						m_NumPushes.fetch_add(1, std::memory_order_release);
+						m_NumPushes.notify_all();
+						return true;
+					}
+				}
+				else if (static_cast<ptrdiff_t>(sequence - position) < 0)
+				{
+					return false;	// full, the slot still holds the value pushed a lap ago
+				}
+				else
+				{
+					position = m_PushPosition.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		bool TryPop(T& outValue)
+		{
+			size_t position = m_PopPosition.load(std::memory_order_relaxed);
+			while (true)
+			{
+				Slot& slot = m_Slots[position & (m_Capacity - 1)];
+				const size_t sequence = slot.m_Sequence.load(std::memory_order_acquire);
+				if (sequence == position + 1)
+				{
+					if (m_PopPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					{
+						outValue = std::move(slot.m_Value);
+						slot.m_Sequence.store(position + m_Capacity, std::memory_order_release);
+						m_NumPops.fetch_add(1, std::memory_order_release);
+						m_NumPops.notify_all();
+						return true;
+					}
+				}
+				else if (static_cast<ptrdiff_t>(sequence - (position + 1)) < 0)
+				{
+					return false;	// empty, nothing has been pushed to the slot yet
+				}
+				else
+				{
+					position = m_PopPosition.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		void Push(T&& value)
+		{
+			while (true)
+			{
+				const uint32_t numPops = m_NumPops.load(std::memory_order_acquire);
+				if (TryPush(std::move(value)))
+				{
+					return;
+				}
+				m_NumPops.wait(numPops);
+			}
+		}
+
+		// waits for a value, returns false once the queue is closed and empty
+		bool Pop(T& outValue)
+		{
+			while (true)
+			{
+				const uint32_t numPushes = m_NumPushes.load(std::memory_order_acquire);
+				if (TryPop(outValue))
+				{
+					return true;
+				}
+				if (m_IsClosed.load(std::memory_order_acquire))
+				{
+					return TryPop(outValue);
+				}
+				m_NumPushes.wait(numPushes);
+			}
+		}
+
+		// no more values will be pushed, consumers waiting on an empty queue give up
+		void Close()
+		{
+			m_IsClosed.store(true, std::memory_order_release);
+			m_NumPushes.fetch_add(1, std::memory_order_release);
+			m_NumPushes.notify_all();
+		}
+
+	private:
+		struct Slot
+		{
+			std::atomic<size_t> m_Sequence;
+			T m_Value;
+		};
+
+		const size_t m_Capacity;
+		std::unique_ptr<Slot[]> m_Slots;
+		alignas(64) std::atomic<size_t> m_PushPosition = 0;
+		alignas(64) std::atomic<size_t> m_PopPosition = 0;
+		alignas(64) std::atomic<uint32_t> m_NumPushes = 0;	// only used to wake up waiting consumers
+		alignas(64) std::atomic<uint32_t> m_NumPops = 0;	// only used to wake up waiting producers
+		std::atomic<bool> m_IsClosed = false;
+	};
+
+	// Caps the number of bytes held by work in flight across pipeline stages. Acquire() waits until the bytes fit in the budget, a request
+	// larger than the whole budget is let through once no other work is in flight. Memory that the work allocates along the way, or that's
+	// kept around for later work, is added with Charge() instead, which never waits, so the stages holding on to it can't stall each other.
+	// It still counts against the budget and holds back the next Acquire().
+	class InFlightByteBudget
+	{
+	public:
+		InFlightByteBudget(const uint64_t maxNumBytes)
+			: m_MaxNumBytes(maxNumBytes)
+		{
+		}
+
+		void Acquire(const uint64_t numBytes)
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Condition.wait(lock, [this, numBytes]() { return m_NumWorkInFlight == 0 || m_NumBytesInFlight + numBytes <= m_MaxNumBytes; });
+			m_NumBytesInFlight += numBytes;
+			++m_NumWorkInFlight;
+		}
+
+		void Release(const uint64_t numBytes)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_NumBytesInFlight -= numBytes;
+				--m_NumWorkInFlight;
+			}
+			m_Condition.notify_all();
+		}
+
+		void Charge(const uint64_t numBytes)
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_NumBytesInFlight += numBytes;
+		}
+
+		void Refund(const uint64_t numBytes)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_NumBytesInFlight -= numBytes;
+			}
+			m_Condition.notify_all();
+		}
+
+		uint64_t GetMaxNumBytes() const { return m_MaxNumBytes; }
+
+	private:
+		const uint64_t m_MaxNumBytes;
+		std::mutex m_Mutex;
+		std::condition_variable m_Condition;
+		uint64_t m_NumBytesInFlight = 0;
+		uint32_t m_NumWorkInFlight = 0;
+	};
+
+	// Runs an action for every element of a span on the ThreadPool, elements with a higher score first.
+	// Scores are computed once when the score function is set. Execute() waits for the workers to go through all of the elements, so it must
+	// not be called from an action running on the ThreadPool.
 	template <typename ElementType>
 	struct ParallelForRunner
 	{
 	public:
-		using ActionFnSig = std::function<void(const ElementType& element, uint32_t elementIndex)>;
-		using ScoreFnSig = std::function<uint32_t(const ElementType& element, uint32_t elementIndex)>;
-
 		ParallelForRunner(const std::span<ElementType>& elements)
 			: m_Elements(elements)
+			, m_ThreadPool(ThreadPool::Get())
 		{
-			m_NumThreads = ThreadConfig::GetDefaultNumThreads();
 		}
 
-		void SetScoreFunction(ScoreFnSig&& scoreFn) { m_ScoreFunction = scoreFn; }
-		void SetNumThreads(uint32_t numThreads) { m_NumThreads = numThreads; }
-
-		void Execute(ActionFnSig&& actionFn)
+		template <typename ScoreFn>
+		void SetScoreFunction(ScoreFn&& scoreFn)
 		{
-			std::vector<uint32_t> indexQueue;
-			indexQueue.reserve(m_Elements.size());
+			m_Scores.resize(m_Elements.size());
 			for (uint32_t i = 0; i < m_Elements.size(); ++i)
 			{
-				indexQueue.push_back(i);
+				m_Scores[i] = scoreFn(m_Elements[i], i);
 			}
+		}
+
+		// number of distinct worker indices actions can run with
+		uint32_t GetNumThreads() const { return m_ThreadPool.GetNumThreads(); }
 
-			if (m_ScoreFunction)
+		template <typename ActionFn>
+		void Execute(ActionFn&& actionFn)
+		{
+			assert(!WorkerThread::IsPoolWorker());
+			if (m_Elements.empty())
 			{
-				std::sort(indexQueue.begin(), indexQueue.end(), [this](const uint32_t lhs, const uint32_t rhs)
-					{
-						return m_ScoreFunction(m_Elements[lhs], lhs) > m_ScoreFunction(m_Elements[rhs], rhs);
-					});
+				return;
 			}
 
-			std::atomic<size_t> currentWorkingIndex;
-			auto workerThreadFn = [&currentWorkingIndex, &indexQueue, &actionFn, this]()
+			std::vector<uint32_t> indexQueue(m_Elements.size());
+			std::iota(indexQueue.begin(), indexQueue.end(), 0u);
+			if (!m_Scores.empty())
+			{
+				std::stable_sort(indexQueue.begin(), indexQueue.end(), [this](const uint32_t lhs, const uint32_t rhs) { return m_Scores[lhs] > m_Scores[rhs]; });
+			}
+
+			// runners that only get to start after all elements have been taken just return, the job state is shared so that they can find out
+			struct JobState
+			{
+				std::atomic<size_t> m_NextIndex = 0;
+				std::atomic<size_t> m_NumElementsDone = 0;
+				size_t m_NumElements = 0;
+				const uint32_t* m_IndexQueue = nullptr;
+				ElementType* m_Elements = nullptr;
+				std::remove_reference_t<ActionFn>* m_ActionFn = nullptr;
+			};
+
+			std::shared_ptr<JobState> jobState = std::make_shared<JobState>();
+			jobState->m_NumElements = m_Elements.size();
+			jobState->m_IndexQueue = indexQueue.data();
+			jobState->m_Elements = m_Elements.data();
+			jobState->m_ActionFn = &actionFn;
+
+			auto runnerFn = [jobState]()
 				{
+					JobState& state = *jobState;
 					while (true)
 					{
-						const size_t workingIndex = currentWorkingIndex++;
-						if (workingIndex >= m_Elements.size())
+						const size_t workingIndex = state.m_NextIndex++;
+						if (workingIndex >= state.m_NumElements)
 						{
 							return;
 						}
 
-						actionFn(m_Elements[indexQueue[workingIndex]], indexQueue[workingIndex]);
+						const uint32_t elementIndex = state.m_IndexQueue[workingIndex];
+						(*state.m_ActionFn)(state.m_Elements[elementIndex], elementIndex);
+						if (++state.m_NumElementsDone == state.m_NumElements)
+						{
+							state.m_NumElementsDone.notify_all();
+						}
 					}
 				};
 
-			std::vector<std::thread> workerThreads;
-			workerThreads.reserve(m_NumThreads);
-			for (uint32_t i = 0; i < m_NumThreads; ++i)
+			const size_t numRunners = std::min<size_t>(GetNumThreads(), m_Elements.size());
+			for (size_t i = 0; i < numRunners; ++i)
 			{
-				workerThreads.emplace_back(workerThreadFn);
+				m_ThreadPool.Submit(runnerFn);
 			}
-			for (uint32_t i = 0; i < m_NumThreads; ++i)
+
+			for (size_t numDone = jobState->m_NumElementsDone; numDone != m_Elements.size(); numDone = jobState->m_NumElementsDone)
 			{
-				workerThreads[i].join();
+				jobState->m_NumElementsDone.wait(numDone);
 			}
 		}
 
 	private:
 		std::span<ElementType> m_Elements;
-		ScoreFnSig m_ScoreFunction;
-		uint32_t m_NumThreads;
+		std::vector<uint32_t> m_Scores;
+		ThreadPool& m_ThreadPool;
 	};
 }
\ No newline at end of file